@@ -5,22 +5,64 @@
 #include <math.h>       // For mathematic operations.
 #ifdef __APPLE__
 #include <OpenGL/gl.h>  // The GL header file.
+#include <OpenGL/glext.h>  // OpenGL extension function types.
 #include <GLUT/glut.h>  // The GL Utility Toolkit (glut) header.
+#include <dlfcn.h>      // For looking up extension functions.
 #else
 #ifdef _WIN32
 #include <windows.h>
+#include <direct.h>     // For creating the texture cache folder.
 #endif
 #include "objloader.hpp"
 #include "cubeobjloader.hpp"
 #include <GL/gl.h>      // The GL header file.
 #include <GL/glut.h>       // The GL Utility Toolkit (glut) header (boundled with this program).
+#include <GL/glext.h>   // OpenGL extension function types.
+#ifndef _WIN32
+#include <GL/glx.h>     // For looking up extension functions.
+#endif
+#endif
+#include <stdio.h>      // For printing load reports.
+#include <limits>       // For float limits in degenerate face checks.
+#include <algorithm>    // For sorting face keys.
+#include <unordered_map>  // For the vertex welding spatial hash.
+#include <memory_resource>  // For the per-load arena.
+#include <map>          // For the resident mesh store.
+#include <new>          // For counting allocations and placing the render worker state in shared memory.
+#include <stdlib.h>
+#include <thread>       // For parallel index remapping and the update thread.
+#include <atomic>       // For the lock-free frame and input buffers.
+#include <chrono>       // For the update thread sleep.
+#include <mutex>        // For the frame capture job queue.
+#include <condition_variable>
+#include <deque>
+#include <string>       // For hot reload file names.
+#include <string.h>     // For comparing texture rows.
+#include <stdint.h>     // For fixed size fields in the octree file.
+#include <ctype.h>      // For parsing point files.
+#include <queue>        // For the point cloud refinement queue.
+#ifdef __linux__
+#include <sys/inotify.h>  // For watching assets for hot reload.
+#include <poll.h>
+#include <semaphore.h>    // For the render worker processes.
+#include <pthread.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#endif
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>      // For mapping point cloud files.
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>  // For peak memory use.
 #endif
 
 /*********************************************************************************************
 	GLOBAL VARIABLES
 *********************************************************************************************/
 
-// Rendering mode.
+// Rendering mode. Owned by the update thread, the render thread reads it from the frame state.
 char rendermode;
 char renderobj;
 
@@ -38,7 +80,10 @@ std::vector<std::array<float, 3>> vertices;
 std::vector<std::array<int,   3>> triVertexIndices;
 std::vector<std::array<int,   4>> quadVertexIndices;
 
-// Camera
+// Object rotation, stored as the rotated X, Y and Z axes rather than applied to the vertices
+std::vector<std::array<float, 3>> objAxes;
+
+// Camera. Owned by the update thread, the render thread reads it from the frame state.
 std::vector<std::array<float, 3>> camVectors;
 std::array<float, 3> cam = { 2.8f, 3.4f, 7.7f };
 std::array<float, 3> look = { 0.0f, 0.0f, 0.0f };
@@ -48,6 +93,146 @@ std::array<float, 3> forward_backward = { 0.0f, 0.0f, 1.0f };
 
 // Texture
 GLuint texture;
+const int textureSize = 256;             // Width and height of the BMP textures
+std::vector<unsigned char> texturePixels;  // RGB pixels of the current texture
+
+// Window size, kept up to date by reshape()
+int windowWidth  = 500;
+int windowHeight = 500;
+
+// Frame capture
+bool capturing    = false;  // Write every frame to disk
+char captureFormat = 'p';   // 'p' for PNG, 'r' for raw PPM
+int captureFrame  = 0;      // Number of the next captured frame
+bool orbiting     = false;  // Turntable camera orbit around the look point
+int orbitStep     = 0;      // Frames since the orbit started
+int orbitFrames   = 360;    // Frames per full orbit
+
+// Dynamic resolution
+bool adaptiveResolution = false;   // Scale the drawn resolution to hold the frame budget
+float frameBudgetMs = 33.3f;       // Target frame time, set with --frame-budget <ms>
+float minResolutionScale = 0.25f;  // Lowest fraction of the window size drawn
+
+// Occlusion culling of mesh chunks in face mode
+bool occlusionCulling = false;
+
+// Lighting and shadows
+GLfloat lightPosition[4] = { 0.0f, 5.0f, 5.0f, 0.0f };  // GL_LIGHT0, directional
+bool shadows = false;            // Shadows from GL_LIGHT0 in face mode
+unsigned int meshGeneration = 0;  // Bumped whenever the geometry of the current object changes
+
+// Input recording and replay
+unsigned int displayFrame = 0;  // Number of frames drawn so far
+bool replaying = false;         // A recorded log is being fed back in (--replay <file>)
+bool replayFast = false;        // Replay by frame number as fast as possible (--replay-fast)
+std::string timingsFile;        // Per frame times of a replay are written here (--timings <file>)
+
+// Point cloud
+const char * pointCloudFile = NULL;  // Octree file given with --pointcloud <file>
+unsigned int octreeChunkPoints = 16384;  // Points per octree node when building
+size_t cloudPointBudget = 2000000;    // Most points drawn per frame, set with --point-budget <n>
+size_t cloudCacheSlots = 512;        // Node chunks held in memory
+float maxCloudError = 1.5f;          // Nodes are refined until their points are this many pixels apart
+
+// Sort-last parallel rendering - worker processes drawing triangle meshes, set with --workers <n>
+int parallelWorkers = 0;
+
+// Mesh cleanup - vertices closer than this are welded together on import
+float weldEpsilon = 1e-5f;
+
+/*********************************************************************************************
+	GL EXTENSIONS
+*********************************************************************************************/
+
+// Pixel buffer objects (OpenGL 2.1), used for asynchronous frame capture
+PFNGLGENBUFFERSPROC    pglGenBuffers    = NULL;
+PFNGLBINDBUFFERPROC    pglBindBuffer    = NULL;
+PFNGLBUFFERDATAPROC    pglBufferData    = NULL;
+PFNGLMAPBUFFERPROC     pglMapBuffer     = NULL;
+PFNGLUNMAPBUFFERPROC   pglUnmapBuffer   = NULL;
+PFNGLDELETEBUFFERSPROC pglDeleteBuffers = NULL;
+bool hasPixelBuffers = false;
+
+// Framebuffer objects (OpenGL 3.0), used for dynamic resolution
+PFNGLGENFRAMEBUFFERSPROC         pglGenFramebuffers         = NULL;
+PFNGLBINDFRAMEBUFFERPROC         pglBindFramebuffer         = NULL;
+PFNGLFRAMEBUFFERRENDERBUFFERPROC pglFramebufferRenderbuffer = NULL;
+PFNGLFRAMEBUFFERTEXTURE2DPROC    pglFramebufferTexture2D    = NULL;
+PFNGLCHECKFRAMEBUFFERSTATUSPROC  pglCheckFramebufferStatus  = NULL;
+PFNGLGENRENDERBUFFERSPROC        pglGenRenderbuffers        = NULL;
+PFNGLBINDRENDERBUFFERPROC        pglBindRenderbuffer        = NULL;
+PFNGLRENDERBUFFERSTORAGEPROC     pglRenderbufferStorage     = NULL;
+bool hasFramebuffers = false;
+
+// Occlusion queries (OpenGL 1.5), used to skip hidden chunks of the mesh
+PFNGLGENQUERIESPROC        pglGenQueries        = NULL;
+PFNGLDELETEQUERIESPROC     pglDeleteQueries     = NULL;
+PFNGLBEGINQUERYPROC        pglBeginQuery        = NULL;
+PFNGLENDQUERYPROC          pglEndQuery          = NULL;
+PFNGLGETQUERYOBJECTUIVPROC pglGetQueryObjectuiv = NULL;
+bool hasOcclusionQueries = false;
+
+// Compressed textures (OpenGL 1.3 with EXT_texture_compression_s3tc), used for BC1 textures
+PFNGLCOMPRESSEDTEXIMAGE2DPROC    pglCompressedTexImage2D    = NULL;
+PFNGLCOMPRESSEDTEXSUBIMAGE2DPROC pglCompressedTexSubImage2D = NULL;
+bool hasS3TC = false;
+
+// Multitexture (OpenGL 1.3), used with framebuffer objects for shadow maps
+PFNGLACTIVETEXTUREPROC pglActiveTexture = NULL;
+bool hasShadowMaps = false;
+
+// Returns the address of an OpenGL function that is not exported by the GL library itself
+void (*getGLProc(const char * name))() {
+#if defined(_WIN32)
+	return (void (*)())wglGetProcAddress(name);
+#elif defined(__APPLE__)
+	return (void (*)())dlsym(RTLD_DEFAULT, name);
+#else
+	return (void (*)())glXGetProcAddressARB((const GLubyte *)name);
+#endif
+}
+
+// Looks up the extension functions, features whose functions are missing are turned off.
+// Must be called once the GL context exists.
+void loadGLExtensions() {
+	pglGenBuffers    = (PFNGLGENBUFFERSPROC)getGLProc("glGenBuffers");
+	pglBindBuffer    = (PFNGLBINDBUFFERPROC)getGLProc("glBindBuffer");
+	pglBufferData    = (PFNGLBUFFERDATAPROC)getGLProc("glBufferData");
+	pglMapBuffer     = (PFNGLMAPBUFFERPROC)getGLProc("glMapBuffer");
+	pglUnmapBuffer   = (PFNGLUNMAPBUFFERPROC)getGLProc("glUnmapBuffer");
+	pglDeleteBuffers = (PFNGLDELETEBUFFERSPROC)getGLProc("glDeleteBuffers");
+	hasPixelBuffers = pglGenBuffers && pglBindBuffer && pglBufferData && pglMapBuffer &&
+		pglUnmapBuffer && pglDeleteBuffers;
+
+	pglGenFramebuffers         = (PFNGLGENFRAMEBUFFERSPROC)getGLProc("glGenFramebuffers");
+	pglBindFramebuffer         = (PFNGLBINDFRAMEBUFFERPROC)getGLProc("glBindFramebuffer");
+	pglFramebufferRenderbuffer = (PFNGLFRAMEBUFFERRENDERBUFFERPROC)getGLProc("glFramebufferRenderbuffer");
+	pglFramebufferTexture2D    = (PFNGLFRAMEBUFFERTEXTURE2DPROC)getGLProc("glFramebufferTexture2D");
+	pglCheckFramebufferStatus  = (PFNGLCHECKFRAMEBUFFERSTATUSPROC)getGLProc("glCheckFramebufferStatus");
+	pglGenRenderbuffers        = (PFNGLGENRENDERBUFFERSPROC)getGLProc("glGenRenderbuffers");
+	pglBindRenderbuffer        = (PFNGLBINDRENDERBUFFERPROC)getGLProc("glBindRenderbuffer");
+	pglRenderbufferStorage     = (PFNGLRENDERBUFFERSTORAGEPROC)getGLProc("glRenderbufferStorage");
+	hasFramebuffers = pglGenFramebuffers && pglBindFramebuffer && pglFramebufferRenderbuffer &&
+		pglFramebufferTexture2D && pglCheckFramebufferStatus && pglGenRenderbuffers && pglBindRenderbuffer &&
+		pglRenderbufferStorage;
+
+	pglGenQueries        = (PFNGLGENQUERIESPROC)getGLProc("glGenQueries");
+	pglDeleteQueries     = (PFNGLDELETEQUERIESPROC)getGLProc("glDeleteQueries");
+	pglBeginQuery        = (PFNGLBEGINQUERYPROC)getGLProc("glBeginQuery");
+	pglEndQuery          = (PFNGLENDQUERYPROC)getGLProc("glEndQuery");
+	pglGetQueryObjectuiv = (PFNGLGETQUERYOBJECTUIVPROC)getGLProc("glGetQueryObjectuiv");
+	hasOcclusionQueries = pglGenQueries && pglDeleteQueries && pglBeginQuery && pglEndQuery &&
+		pglGetQueryObjectuiv;
+
+	pglCompressedTexImage2D    = (PFNGLCOMPRESSEDTEXIMAGE2DPROC)getGLProc("glCompressedTexImage2D");
+	pglCompressedTexSubImage2D = (PFNGLCOMPRESSEDTEXSUBIMAGE2DPROC)getGLProc("glCompressedTexSubImage2D");
+	const char * extensions = (const char *)glGetString(GL_EXTENSIONS);
+	hasS3TC = pglCompressedTexImage2D && pglCompressedTexSubImage2D && extensions != NULL &&
+		strstr(extensions, "GL_EXT_texture_compression_s3tc") != NULL;
+
+	pglActiveTexture = (PFNGLACTIVETEXTUREPROC)getGLProc("glActiveTexture");
+	hasShadowMaps = hasFramebuffers && pglActiveTexture;
+}
 
 /*********************************************************************************************
 	FUNCTIONS
@@ -63,6 +248,7 @@ void InitGL(GLvoid)
 	glDepthFunc(GL_LEQUAL);                // The type of depth testing to do.
 	glEnable(GL_COLOR_MATERIAL);
 	glHint(GL_PERSPECTIVE_CORRECTION_HINT, GL_NICEST);
+	loadGLExtensions();
 }
 
 void idle(void)
@@ -98,6 +284,11 @@ std::array<float, 3> calcNormal(std::array<float, 3> v1, std::array<float, 3> v2
 	// Calculates the length of the cross product result
 	float normal_length = vectorLength(normal);
 
+	// Degenerate faces have no direction, return a zero normal instead of dividing by zero
+	if (normal_length < std::numeric_limits<float>::min()) {
+		return { 0.0f, 0.0f, 0.0f };
+	}
+
 	// The normal is the cross product result divided by the normal length
 	normal[0] /= normal_length;
 	normal[1] /= normal_length;
@@ -318,29 +509,469 @@ void translateCam(int direction) {
 	}
 }
 
+/*********************************************************************************************
+	FRAME STATE
+*********************************************************************************************/
+
+// Immutable copy of the application state that the render thread draws one frame from.
+// The update thread fills one of three buffers and swaps it through frameMiddle, so
+// neither thread ever waits on the other.
+struct FrameState {
+	std::array<float, 3> cam;
+	std::array<float, 3> look;
+	std::array<std::array<float, 3>, 3> objAxes;
+	char rendermode;
+	unsigned int inputsApplied;  // Number of input events this state includes
+};
+
+// Input event passed from the GLUT callbacks to the update thread
+struct InputEvent {
+	bool special;  // true for arrow keys, false for standard keys
+	int key;
+};
+
+// Triple buffer. frameMiddle holds the index of the middle buffer, with frameFresh added when
+// it holds an unread frame.
+const int frameFresh = 4;
+FrameState frameBuffers[3];
+std::atomic<int> frameMiddle(1);
+int frameBack  = 0;  // Only used by the update thread
+int frameFront = 2;  // Only used by the render thread
+
+// Single producer, single consumer ring of input events
+const unsigned int inputQueueSize = 256;
+InputEvent inputQueue[inputQueueSize];
+std::atomic<unsigned int> inputHead(0);
+std::atomic<unsigned int> inputTail(0);
+
+// Number of input events applied by the update thread
+unsigned int inputsApplied = 0;
+
+// Number of input events pushed by the render thread
+unsigned int inputsPushed = 0;
+
+// Sets the object axes back to the identity rotation
+void resetObjectAxes() {
+	objAxes.clear();
+	objAxes.push_back({ 1.0f, 0.0f, 0.0f });
+	objAxes.push_back({ 0.0f, 1.0f, 0.0f });
+	objAxes.push_back({ 0.0f, 0.0f, 1.0f });
+}
+
+// Copies the update thread's state into a frame
+void writeFrameState(FrameState &frame) {
+	frame.cam = cam;
+	frame.look = camVectors[3];
+	for (int i = 0; i < 3; i++) {
+		frame.objAxes[i] = objAxes[i];
+	}
+	frame.rendermode = rendermode;
+	frame.inputsApplied = inputsApplied;
+}
+
+// Update thread - publishes the back buffer and takes the old middle buffer to write into next
+void publishFrame() {
+	writeFrameState(frameBuffers[frameBack]);
+	int old = frameMiddle.exchange(frameBack | frameFresh, std::memory_order_acq_rel);
+	frameBack = old & 3;
+}
+
+// Render thread - takes the newest published frame if there is one, otherwise keeps the last
+const FrameState &acquireFrame() {
+	if (frameMiddle.load(std::memory_order_acquire) & frameFresh) {
+		int old = frameMiddle.exchange(frameFront, std::memory_order_acq_rel);
+		frameFront = old & 3;
+	}
+	return frameBuffers[frameFront];
+}
+
+// Render thread - queues an input event. If the update thread is 256 events behind, a replay
+// waits for it to catch up so no recorded event is lost, live input drops the event.
+void pushInput(bool special, int key) {
+	unsigned int tail = inputTail.load(std::memory_order_relaxed);
+	while (tail - inputHead.load(std::memory_order_acquire) == inputQueueSize) {
+		if (!replaying) {
+			printf("Input queue full, key press dropped\n");
+			return;
+		}
+		std::this_thread::yield();
+	}
+	inputQueue[tail % inputQueueSize] = { special, key };
+	inputTail.store(tail + 1, std::memory_order_release);
+	inputsPushed += 1;
+}
+
+// Update thread - takes the oldest queued input event, returns false if there are none
+bool popInput(InputEvent &event) {
+	unsigned int head = inputHead.load(std::memory_order_relaxed);
+	if (head == inputTail.load(std::memory_order_acquire)) {
+		return false;
+	}
+	event = inputQueue[head % inputQueueSize];
+	inputHead.store(head + 1, std::memory_order_release);
+	return true;
+}
+
+// Builds the column-major OpenGL matrix that applies the object rotation
+void objectMatrix(const FrameState &frame, GLfloat matrix[16]) {
+	for (int i = 0; i < 3; i++) {
+		matrix[i * 4 + 0] = frame.objAxes[i][0];
+		matrix[i * 4 + 1] = frame.objAxes[i][1];
+		matrix[i * 4 + 2] = frame.objAxes[i][2];
+		matrix[i * 4 + 3] = 0.0f;
+	}
+	matrix[12] = 0.0f;
+	matrix[13] = 0.0f;
+	matrix[14] = 0.0f;
+	matrix[15] = 1.0f;
+}
+
+// Applies the placement of an object in the scene to the current matrix, the translation and
+// scale of the bunny and screwdriver followed by the object rotation. Shared by the main pass
+// and the shadow pass so both see the object in the same place.
+void placeObject(char obj, const GLfloat rotation[16]) {
+	if (obj == '2') {
+		glTranslatef(-0.5, 0.0, 0.0);
+		glScalef(0.5, 0.5, 0.5);
+	}
+	else if (obj == '3') {
+		glTranslatef(-0.2, 4.0, 0.0);
+		glScalef(1.6, 1.6, 1.6);
+	}
+	glMultMatrixf(rotation);
+}
+
+/*********************************************************************************************
+	TEXTURE COMPRESSION
+*********************************************************************************************/
+
+// A BC1 (DXT1) compressed mip chain, 8 bytes for every 4x4 block of pixels
+struct CompressedTexture {
+	int width;
+	int height;
+	std::vector<std::vector<unsigned char>> levels;
+};
+
+CompressedTexture textureBlocks;  // Blocks of the current texture, empty if it is uncompressed
+
+// Returns the width or height of a mip level
+int mipSize(int size, int level) {
+	return std::max(1, size >> level);
+}
+
+// Builds the RGB mip chain down to 1x1, each level a 2x2 box filter of the one above
+std::vector<std::vector<unsigned char>> buildMipChain(const std::vector<unsigned char> &rgb, int width, int height) {
+	std::vector<std::vector<unsigned char>> chain(1, rgb);
+	int level = 0;
+	while (mipSize(width, level) > 1 || mipSize(height, level) > 1) {
+		int w = mipSize(width, level), h = mipSize(height, level);
+		int nw = mipSize(width, level + 1), nh = mipSize(height, level + 1);
+		const std::vector<unsigned char> &src = chain[level];
+		std::vector<unsigned char> dst((size_t)nw * nh * 3);
+		for (int y = 0; y < nh; y++) {
+			int y0 = std::min(y * 2, h - 1), y1 = std::min(y * 2 + 1, h - 1);
+			for (int x = 0; x < nw; x++) {
+				int x0 = std::min(x * 2, w - 1), x1 = std::min(x * 2 + 1, w - 1);
+				for (int c = 0; c < 3; c++) {
+					int sum = src[(y0 * w + x0) * 3 + c] + src[(y0 * w + x1) * 3 + c] +
+						src[(y1 * w + x0) * 3 + c] + src[(y1 * w + x1) * 3 + c];
+					dst[(y * nw + x) * 3 + c] = (unsigned char)((sum + 2) / 4);
+				}
+			}
+		}
+		chain.push_back(std::move(dst));
+		level++;
+	}
+	return chain;
+}
+
+// Packs an 8 bit colour into 5:6:5 bits
+unsigned short packRGB565(const float c[3]) {
+	int r = std::max(0, std::min(31, (int)(c[0] * 31.0f / 255.0f + 0.5f)));
+	int g = std::max(0, std::min(63, (int)(c[1] * 63.0f / 255.0f + 0.5f)));
+	int b = std::max(0, std::min(31, (int)(c[2] * 31.0f / 255.0f + 0.5f)));
+	return (unsigned short)((r << 11) | (g << 5) | b);
+}
+
+// Expands a 5:6:5 colour back to the 8 bit values the GPU decodes it to
+void unpackRGB565(unsigned short c, float out[3]) {
+	int r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+	out[0] = (float)((r << 3) | (r >> 2));
+	out[1] = (float)((g << 2) | (g >> 4));
+	out[2] = (float)((b << 3) | (b >> 2));
+}
+
+// Encodes 16 RGB pixels as one BC1 block. The end points are the extremes of the pixels along
+// their principal axis, found by power iteration on the colour covariance. The loops run over
+// fixed size arrays so the compiler can vectorise them.
+void encodeBC1Block(const float pixels[16][3], unsigned char out[8]) {
+	float mean[3] = { 0.0f, 0.0f, 0.0f };
+	for (int i = 0; i < 16; i++) {
+		for (int c = 0; c < 3; c++) {
+			mean[c] += pixels[i][c] / 16.0f;
+		}
+	}
+	float cov[6] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+	for (int i = 0; i < 16; i++) {
+		float d[3] = { pixels[i][0] - mean[0], pixels[i][1] - mean[1], pixels[i][2] - mean[2] };
+		cov[0] += d[0] * d[0]; cov[1] += d[0] * d[1]; cov[2] += d[0] * d[2];
+		cov[3] += d[1] * d[1]; cov[4] += d[1] * d[2]; cov[5] += d[2] * d[2];
+	}
+	float axis[3] = { 1.0f, 1.0f, 1.0f };
+	for (int iteration = 0; iteration < 6; iteration++) {
+		float next[3] = {
+			cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2],
+			cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2],
+			cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2]
+		};
+		float length = sqrt(next[0] * next[0] + next[1] * next[1] + next[2] * next[2]);
+		if (length < 1e-6f) {
+			break;
+		}
+		for (int c = 0; c < 3; c++) {
+			axis[c] = next[c] / length;
+		}
+	}
+
+	float minT = std::numeric_limits<float>::max(), maxT = -std::numeric_limits<float>::max();
+	for (int i = 0; i < 16; i++) {
+		float t = (pixels[i][0] - mean[0]) * axis[0] + (pixels[i][1] - mean[1]) * axis[1] + (pixels[i][2] - mean[2]) * axis[2];
+		minT = std::min(minT, t);
+		maxT = std::max(maxT, t);
+	}
+	float end0[3], end1[3];
+	for (int c = 0; c < 3; c++) {
+		end0[c] = mean[c] + axis[c] * maxT;
+		end1[c] = mean[c] + axis[c] * minT;
+	}
+
+	// The first colour must be the larger for the 4 colour mode, equal colours use index 0 only
+	unsigned short c0 = packRGB565(end0), c1 = packRGB565(end1);
+	if (c0 < c1) {
+		std::swap(c0, c1);
+	}
+	float palette[4][3];
+	unpackRGB565(c0, palette[0]);
+	unpackRGB565(c1, palette[1]);
+	for (int c = 0; c < 3; c++) {
+		palette[2][c] = (2.0f * palette[0][c] + palette[1][c]) / 3.0f;
+		palette[3][c] = (palette[0][c] + 2.0f * palette[1][c]) / 3.0f;
+	}
+
+	unsigned int indices = 0;
+	if (c0 != c1) {
+		for (int i = 0; i < 16; i++) {
+			float best = std::numeric_limits<float>::max();
+			unsigned int bestIndex = 0;
+			for (unsigned int p = 0; p < 4; p++) {
+				float dr = pixels[i][0] - palette[p][0], dg = pixels[i][1] - palette[p][1], db = pixels[i][2] - palette[p][2];
+				float distance = dr * dr + dg * dg + db * db;
+				if (distance < best) {
+					best = distance;
+					bestIndex = p;
+				}
+			}
+			indices |= bestIndex << (i * 2);
+		}
+	}
+
+	out[0] = c0 & 0xFF;
+	out[1] = c0 >> 8;
+	out[2] = c1 & 0xFF;
+	out[3] = c1 >> 8;
+	out[4] = indices & 0xFF;
+	out[5] = (indices >> 8) & 0xFF;
+	out[6] = (indices >> 16) & 0xFF;
+	out[7] = (indices >> 24) & 0xFF;
+}
+
+// Encodes block rows firstRow to lastRow of an RGB image into blocks, which holds the whole
+// level. Rows are shared between threads. Pixels past the edge of images smaller than a block
+// repeat the edge pixel.
+void encodeBC1Rows(const std::vector<unsigned char> &rgb, int width, int height, int firstRow, int lastRow,
+	std::vector<unsigned char> &blocks) {
+	int blocksWide = (width + 3) / 4;
+	blocks.resize((size_t)blocksWide * ((height + 3) / 4) * 8);
+
+	unsigned int threads = std::max(1u, std::min(std::thread::hardware_concurrency(), (unsigned int)(lastRow - firstRow + 1) / 4));
+	std::atomic<int> nextRow(firstRow);
+	std::vector<std::thread> workers;
+	for (unsigned int t = 0; t < threads; t++) {
+		workers.emplace_back([&]() {
+			int row;
+			while ((row = nextRow.fetch_add(1)) <= lastRow) {
+				for (int bx = 0; bx < blocksWide; bx++) {
+					float pixels[16][3];
+					for (int i = 0; i < 16; i++) {
+						int x = std::min(bx * 4 + (i & 3), width - 1);
+						int y = std::min(row * 4 + (i >> 2), height - 1);
+						for (int c = 0; c < 3; c++) {
+							pixels[i][c] = rgb[((size_t)y * width + x) * 3 + c];
+						}
+					}
+					encodeBC1Block(pixels, &blocks[((size_t)row * blocksWide + bx) * 8]);
+				}
+			}
+		});
+	}
+	for (size_t t = 0; t < workers.size(); t++) {
+		workers[t].join();
+	}
+}
+
+// Compresses a whole RGB image and its mip chain
+CompressedTexture compressTexture(const std::vector<unsigned char> &rgb, int width, int height) {
+	CompressedTexture compressed;
+	compressed.width = width;
+	compressed.height = height;
+	std::vector<std::vector<unsigned char>> chain = buildMipChain(rgb, width, height);
+	compressed.levels.resize(chain.size());
+	for (size_t level = 0; level < chain.size(); level++) {
+		int w = mipSize(width, level), h = mipSize(height, level);
+		encodeBC1Rows(chain[level], w, h, 0, (h + 3) / 4 - 1, compressed.levels[level]);
+	}
+	return compressed;
+}
+
+// 64 bit FNV-1a hash of the source pixels, the key of the texture cache
+unsigned long long hashPixels(const std::vector<unsigned char> &rgb, int width, int height) {
+	unsigned long long hash = 1469598103934665603ULL;
+	unsigned int size[2] = { (unsigned int)width, (unsigned int)height };
+	const unsigned char * sizeBytes = (const unsigned char *)size;
+	for (size_t i = 0; i < sizeof(size); i++) {
+		hash = (hash ^ sizeBytes[i]) * 1099511628211ULL;
+	}
+	for (size_t i = 0; i < rgb.size(); i++) {
+		hash = (hash ^ rgb[i]) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+// Returns the cache file of a texture
+std::string textureCachePath(unsigned long long hash) {
+	char name[64];
+	snprintf(name, sizeof(name), "texcache/%016llx.bc1", hash);
+	return name;
+}
+
+// Returns the number of levels in a full mip chain
+int mipCount(int width, int height) {
+	int levels = 1;
+	while (mipSize(width, levels - 1) > 1 || mipSize(height, levels - 1) > 1) {
+		levels++;
+	}
+	return levels;
+}
+
+// Reads the compressed mip chain of a width x height texture from the cache. Returns false if
+// it is not there, or if the file doesn't hold exactly that chain, e.g. it is corrupt or was
+// written by an older version.
+bool readTextureCache(unsigned long long hash, int width, int height, CompressedTexture &compressed) {
+	FILE * file = fopen(textureCachePath(hash).c_str(), "rb");
+	if (file == NULL) {
+		return false;
+	}
+	char magic[8];
+	unsigned int header[3];
+	bool ok = fread(magic, 8, 1, file) == 1 && memcmp(magic, "BC1TEX1", 8) == 0 && fread(header, sizeof(header), 1, file) == 1 &&
+		header[0] == (unsigned int)width && header[1] == (unsigned int)height && header[2] == (unsigned int)mipCount(width, height);
+	if (ok) {
+		compressed.width = width;
+		compressed.height = height;
+		compressed.levels.resize(header[2]);
+		for (size_t level = 0; level < compressed.levels.size() && ok; level++) {
+			unsigned int expected = (unsigned int)((mipSize(width, level) + 3) / 4 * ((mipSize(height, level) + 3) / 4) * 8);
+			unsigned int bytes;
+			ok = fread(&bytes, 4, 1, file) == 1 && bytes == expected;
+			compressed.levels[level].resize(ok ? bytes : 0);
+			ok = ok && fread(compressed.levels[level].data(), 1, bytes, file) == bytes;
+		}
+	}
+	fclose(file);
+	return ok;
+}
+
+// Writes a compressed mip chain to the cache, through a temporary file so a reader never sees
+// half a file
+void writeTextureCache(unsigned long long hash, const CompressedTexture &compressed) {
+#ifdef _WIN32
+	_mkdir("texcache");
+#else
+	mkdir("texcache", 0755);
+#endif
+	std::string path = textureCachePath(hash);
+	std::string temp = path + ".tmp";
+	FILE * file = fopen(temp.c_str(), "wb");
+	if (file == NULL) {
+		return;
+	}
+	unsigned int header[3] = { (unsigned int)compressed.width, (unsigned int)compressed.height, (unsigned int)compressed.levels.size() };
+	fwrite("BC1TEX1", 8, 1, file);
+	fwrite(header, sizeof(header), 1, file);
+	for (size_t level = 0; level < compressed.levels.size(); level++) {
+		unsigned int bytes = (unsigned int)compressed.levels[level].size();
+		fwrite(&bytes, 4, 1, file);
+		fwrite(compressed.levels[level].data(), 1, bytes, file);
+	}
+	fclose(file);
+	remove(path.c_str());
+	rename(temp.c_str(), path.c_str());
+}
+
+// Uploads block rows firstRow to lastRow of level 0, and the matching rows of the smaller
+// levels, of the bound compressed texture
+void uploadCompressedRows(const CompressedTexture &compressed, int firstRow, int lastRow) {
+	for (size_t level = 0; level < compressed.levels.size(); level++) {
+		int w = mipSize(compressed.width, level), h = mipSize(compressed.height, level);
+		int blocksWide = (w + 3) / 4;
+		int first = std::min((firstRow * 4 >> level) / 4, (h + 3) / 4 - 1);
+		int last = std::min(((lastRow * 4 + 3) >> level) / 4, (h + 3) / 4 - 1);
+		int y = first * 4;
+		int rows = std::min(h, (last + 1) * 4) - y;
+		pglCompressedTexSubImage2D(GL_TEXTURE_2D, level, 0, y, w, rows, GL_COMPRESSED_RGB_S3TC_DXT1_EXT,
+			(last - first + 1) * blocksWide * 8, &compressed.levels[level][(size_t)first * blocksWide * 8]);
+	}
+}
+
+// Re-encodes the block rows covering pixel rows first to last of the new pixels, uploads them
+// and stores the updated chain in the cache in place of the entry for the old pixels
+void recompressTextureRows(const std::vector<unsigned char> &rgb, int first, int last) {
+	int firstRow = first / 4, lastRow = last / 4;
+	std::vector<std::vector<unsigned char>> chain = buildMipChain(rgb, textureBlocks.width, textureBlocks.height);
+	for (size_t level = 0; level < chain.size() && level < textureBlocks.levels.size(); level++) {
+		int w = mipSize(textureBlocks.width, level), h = mipSize(textureBlocks.height, level);
+		int levelFirst = std::min((firstRow * 4 >> level) / 4, (h + 3) / 4 - 1);
+		int levelLast = std::min(((lastRow * 4 + 3) >> level) / 4, (h + 3) / 4 - 1);
+		encodeBC1Rows(chain[level], w, h, levelFirst, levelLast, textureBlocks.levels[level]);
+	}
+	glBindTexture(GL_TEXTURE_2D, texture);
+	uploadCompressedRows(textureBlocks, firstRow, lastRow);
+	remove(textureCachePath(hashPixels(texturePixels, textureBlocks.width, textureBlocks.height)).c_str());
+	writeTextureCache(hashPixels(rgb, textureBlocks.width, textureBlocks.height), textureBlocks);
+}
+
 /*********************************************************************************************
 	TEXTURE
 *********************************************************************************************/
 
-// Function copied from http://stackoverflow.com/questions/12518111/how-to-load-a-bmp-on-glut-to-use-it-as-a-texture
-GLuint LoadTexture( const char * filename )
+// Reads the pixels of a 256x256 24 bit BMP into data as RGB. Returns false if the file can't be opened.
+bool readBMP( const char * filename, std::vector<unsigned char> &data )
 {
 	int width, height;
-	unsigned char * data;
 	FILE * file;
 
 	file = fopen( filename, "rb" );
 
-	if ( file == NULL ) return 0;
-	width = 256;
-	height = 256;
-	data = (unsigned char *)malloc( width * height * 3 );
+	if ( file == NULL ) return false;
+	width = textureSize;
+	height = textureSize;
+	data.assign( width * height * 3, 0 );
 
 	// Read the header of the bmp into a char array
 	char header[54];
 	fread( header, 54, 1, file);
 
-	fread( data, width * height * 3, 1, file );
+	fread( data.data(), width * height * 3, 1, file );
 	fclose( file );
 
 	for(int i = 0; i < width * height ; ++i)
@@ -353,10 +984,57 @@ GLuint LoadTexture( const char * filename )
 		data[index] = R;
 		data[index+2] = B;
 	}
+	return true;
+}
+
+// A texture read and encoded off the render thread, waiting for LoadTexture to upload it
+struct PreparedTexture {
+	std::vector<unsigned char> pixels;
+	CompressedTexture blocks;                      // Compressed mip chain, empty without S3TC
+	std::vector<std::vector<unsigned char>> mips;  // RGB mip chain, only built without S3TC
+	bool cached;                                   // The blocks were read from the texture cache
+};
+
+// Reads a BMP and builds the mip chain LoadTexture uploads. Makes no GL calls, so it runs on
+// the loader thread. Returns false if the file can't be opened.
+bool prepareTexture( const char * filename, PreparedTexture &prepared )
+{
+	int width = textureSize;
+	int height = textureSize;
+
+	if ( !readBMP( filename, prepared.pixels ) ) return false;
+	prepared.cached = false;
+
+	if ( !hasS3TC )
+	{
+		prepared.blocks.levels.clear();
+		prepared.mips = buildMipChain( prepared.pixels, width, height );
+		return true;
+	}
+
+	// Compressed mip chains are kept on disk by the hash of the pixels, so only new or edited
+	// textures are encoded
+	unsigned long long hash = hashPixels( prepared.pixels, width, height );
+	prepared.cached = readTextureCache( hash, width, height, prepared.blocks );
+	if ( !prepared.cached )
+	{
+		prepared.blocks = compressTexture( prepared.pixels, width, height );
+		writeTextureCache( hash, prepared.blocks );
+	}
+	return true;
+}
 
+// Function copied from http://stackoverflow.com/questions/12518111/how-to-load-a-bmp-on-glut-to-use-it-as-a-texture
+// Creates a texture from a prepared mip chain and leaves it bound. The pixels and blocks stay
+// in prepared for the caller to keep with the object.
+GLuint LoadTexture( const char * filename, const PreparedTexture &prepared )
+{
+	int width = textureSize;
+	int height = textureSize;
+	GLuint id;
 
-	glGenTextures( 1, &texture );
-	glBindTexture( GL_TEXTURE_2D, texture );
+	glGenTextures( 1, &id );
+	glBindTexture( GL_TEXTURE_2D, id );
 	glTexEnvf( GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE,GL_MODULATE );
 	glTexParameterf( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,GL_LINEAR_MIPMAP_NEAREST );
 
@@ -364,10 +1042,245 @@ GLuint LoadTexture( const char * filename )
 	glTexParameterf( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER,GL_LINEAR );
 	glTexParameterf( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S,GL_REPEAT );
 	glTexParameterf( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T,GL_REPEAT );
-	gluBuild2DMipmaps( GL_TEXTURE_2D, 3, width, height,GL_RGB, GL_UNSIGNED_BYTE, data );
-	free( data );
 
-	return texture;
+	if ( prepared.blocks.levels.empty() )
+	{
+		glPixelStorei( GL_UNPACK_ALIGNMENT, 1 );
+		for ( size_t level = 0; level < prepared.mips.size(); level++ )
+		{
+			glTexImage2D( GL_TEXTURE_2D, level, GL_RGB, mipSize( width, level ), mipSize( height, level ), 0,
+				GL_RGB, GL_UNSIGNED_BYTE, prepared.mips[level].data() );
+		}
+		return id;
+	}
+
+	size_t compressedBytes = 0;
+	size_t uncompressedBytes = 0;
+	for ( size_t level = 0; level < prepared.blocks.levels.size(); level++ )
+	{
+		int w = mipSize( width, level );
+		int h = mipSize( height, level );
+		pglCompressedTexImage2D( GL_TEXTURE_2D, level, GL_COMPRESSED_RGB_S3TC_DXT1_EXT, w, h, 0,
+			prepared.blocks.levels[level].size(), prepared.blocks.levels[level].data() );
+		compressedBytes += prepared.blocks.levels[level].size();
+		uncompressedBytes += (size_t)w * h * 4;  // Drivers store RGB textures as RGBA8
+	}
+	printf( "%s: %s BC1 texture, %zu KB instead of %zu KB\n", filename, prepared.cached ? "cached" : "encoded",
+		compressedBytes / 1024, uncompressedBytes / 1024 );
+
+	return id;
+}
+
+/*********************************************************************************************
+	OCCLUSION CULLING
+*********************************************************************************************/
+
+// A spatial chunk of the current object's faces
+struct MeshChunk {
+	float min[3];
+	float max[3];
+	std::vector<int> faces;  // Indices into triVertexIndices or quadVertexIndices
+	GLuint query;
+	bool queryIssued;        // A query was issued and its result has not been read yet
+	bool visible;            // Visibility from the last query result
+};
+
+std::vector<MeshChunk> meshChunks;
+unsigned int occlusionFrame = 0;
+size_t occlusionSkipped = 0;  // Chunks skipped in the last frame
+std::chrono::steady_clock::time_point occlusionReportTime;
+
+// Deletes the occlusion queries of a set of chunks and empties it
+void releaseMeshChunks(std::vector<MeshChunk> &chunks) {
+	for (size_t c = 0; c < chunks.size(); c++) {
+		if (chunks[c].query != 0) {
+			pglDeleteQueries(1, &chunks[c].query);
+		}
+	}
+	chunks.clear();
+}
+
+// Splits the faces into a grid of chunks by the centre of each face. The grid is sized so
+// each chunk holds about 2000 faces, at most 8 x 8 x 8 chunks. Makes no GL calls, the queries
+// are created when the chunks are first drawn.
+template <size_t N>
+std::vector<MeshChunk> buildMeshChunks(const std::vector<std::array<float, 3>> &points, const std::vector<std::array<int, N>> &faces) {
+	std::vector<MeshChunk> chunks;
+	if (faces.empty()) {
+		return chunks;
+	}
+
+	float min[3] = { std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max() };
+	float max[3] = { -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max() };
+	for (size_t v = 0; v < points.size(); v++) {
+		for (int k = 0; k < 3; k++) {
+			min[k] = std::min(min[k], points[v][k]);
+			max[k] = std::max(max[k], points[v][k]);
+		}
+	}
+
+	int cells = std::max(1, std::min(8, (int)ceil(cbrt(faces.size() / 2000.0))));
+	std::vector<MeshChunk> grid(cells * cells * cells);
+	for (size_t c = 0; c < grid.size(); c++) {
+		for (int k = 0; k < 3; k++) {
+			grid[c].min[k] = std::numeric_limits<float>::max();
+			grid[c].max[k] = -std::numeric_limits<float>::max();
+		}
+		grid[c].query = 0;
+		grid[c].queryIssued = false;
+		grid[c].visible = true;
+	}
+
+	for (size_t f = 0; f < faces.size(); f++) {
+		float centre[3] = { 0.0f, 0.0f, 0.0f };
+		for (size_t i = 0; i < N; i++) {
+			for (int k = 0; k < 3; k++) {
+				centre[k] += points[faces[f][i] - 1][k] / N;
+			}
+		}
+		int cell[3];
+		for (int k = 0; k < 3; k++) {
+			float extent = max[k] - min[k];
+			cell[k] = extent > 0.0f ? std::min(cells - 1, (int)((centre[k] - min[k]) / extent * cells)) : 0;
+		}
+		MeshChunk &chunk = grid[(cell[2] * cells + cell[1]) * cells + cell[0]];
+		chunk.faces.push_back((int)f);
+		// The chunk box covers its whole faces, which may reach into neighbouring cells
+		for (size_t i = 0; i < N; i++) {
+			for (int k = 0; k < 3; k++) {
+				chunk.min[k] = std::min(chunk.min[k], points[faces[f][i] - 1][k]);
+				chunk.max[k] = std::max(chunk.max[k], points[faces[f][i] - 1][k]);
+			}
+		}
+	}
+
+	for (size_t c = 0; c < grid.size(); c++) {
+		if (!grid[c].faces.empty()) {
+			chunks.push_back(std::move(grid[c]));
+		}
+	}
+	return chunks;
+}
+
+// Rebuilds the chunks for the current object
+void rebuildMeshChunks() {
+	meshGeneration++;
+	releaseMeshChunks(meshChunks);
+	if (renderobj == '1' || renderobj == '4') {
+		meshChunks = buildMeshChunks(vertices, quadVertexIndices);
+	}
+	else if (renderobj == '2' || renderobj == '3') {
+		meshChunks = buildMeshChunks(vertices, triVertexIndices);
+	}
+}
+
+// Draws the six sides of a box, used as a stand in for a chunk in occlusion queries
+void drawChunkBox(const MeshChunk &chunk) {
+	const float * lo = chunk.min;
+	const float * hi = chunk.max;
+	glBegin(GL_QUADS);
+	glVertex3f(lo[0], lo[1], lo[2]); glVertex3f(hi[0], lo[1], lo[2]); glVertex3f(hi[0], hi[1], lo[2]); glVertex3f(lo[0], hi[1], lo[2]);
+	glVertex3f(lo[0], lo[1], hi[2]); glVertex3f(lo[0], hi[1], hi[2]); glVertex3f(hi[0], hi[1], hi[2]); glVertex3f(hi[0], lo[1], hi[2]);
+	glVertex3f(lo[0], lo[1], lo[2]); glVertex3f(lo[0], hi[1], lo[2]); glVertex3f(lo[0], hi[1], hi[2]); glVertex3f(lo[0], lo[1], hi[2]);
+	glVertex3f(hi[0], lo[1], lo[2]); glVertex3f(hi[0], lo[1], hi[2]); glVertex3f(hi[0], hi[1], hi[2]); glVertex3f(hi[0], hi[1], lo[2]);
+	glVertex3f(lo[0], lo[1], lo[2]); glVertex3f(lo[0], lo[1], hi[2]); glVertex3f(hi[0], lo[1], hi[2]); glVertex3f(hi[0], lo[1], lo[2]);
+	glVertex3f(lo[0], hi[1], lo[2]); glVertex3f(hi[0], hi[1], lo[2]); glVertex3f(hi[0], hi[1], hi[2]); glVertex3f(lo[0], hi[1], hi[2]);
+	glEnd();
+}
+
+// Draws the chunks front to back, skipping those whose last occlusion query found them hidden.
+// Query results are only read once available, so the CPU never waits on the GPU; a chunk keeps
+// its previous visibility until its result arrives. Hidden chunks are tested with their bounding
+// box each frame, visible chunks are re-tested with their own faces every few frames, staggered
+// so the queries are spread out.
+void drawChunksOccluded(GLenum primitive, void (*emitFace)(int)) {
+	const unsigned int visibleQueryInterval = 4;
+
+	GLfloat modelview[16];
+	glGetFloatv(GL_MODELVIEW_MATRIX, modelview);
+
+	// Sorts the chunks by the eye space depth of their centre, nearest first. Chunks reaching
+	// the near plane or behind the camera are always drawn, their box would be clipped.
+	std::vector<std::pair<float, int>> order;
+	std::vector<char> straddling(meshChunks.size(), 0);
+	for (size_t c = 0; c < meshChunks.size(); c++) {
+		MeshChunk &chunk = meshChunks[c];
+		float nearest = -std::numeric_limits<float>::max();
+		float centre = 0.0f;
+		for (int corner = 0; corner < 8; corner++) {
+			float x = (corner & 1) ? chunk.max[0] : chunk.min[0];
+			float y = (corner & 2) ? chunk.max[1] : chunk.min[1];
+			float z = (corner & 4) ? chunk.max[2] : chunk.min[2];
+			float eyeZ = modelview[2] * x + modelview[6] * y + modelview[10] * z + modelview[14];
+			nearest = std::max(nearest, eyeZ);
+			centre += eyeZ / 8.0f;
+		}
+		straddling[c] = nearest > -0.1f;
+		order.push_back(std::make_pair(-centre, (int)c));
+	}
+	std::sort(order.begin(), order.end());
+
+	occlusionFrame++;
+	occlusionSkipped = 0;
+	for (size_t o = 0; o < order.size(); o++) {
+		int c = order[o].second;
+		MeshChunk &chunk = meshChunks[c];
+		if (chunk.query == 0) {
+			pglGenQueries(1, &chunk.query);
+		}
+
+		// Collects last frame's result if the GPU has it
+		if (chunk.queryIssued) {
+			GLuint available = 0;
+			pglGetQueryObjectuiv(chunk.query, GL_QUERY_RESULT_AVAILABLE, &available);
+			if (available) {
+				GLuint samples = 0;
+				pglGetQueryObjectuiv(chunk.query, GL_QUERY_RESULT, &samples);
+				chunk.visible = samples > 0;
+				chunk.queryIssued = false;
+			}
+		}
+		if (straddling[c]) {
+			chunk.visible = true;
+		}
+
+		if (chunk.visible) {
+			bool query = !chunk.queryIssued && !straddling[c] && (occlusionFrame + c) % visibleQueryInterval == 0;
+			if (query) {
+				pglBeginQuery(GL_SAMPLES_PASSED, chunk.query);
+			}
+			glBegin(primitive);
+			for (size_t f = 0; f < chunk.faces.size(); f++) {
+				emitFace(chunk.faces[f]);
+			}
+			glEnd();
+			if (query) {
+				pglEndQuery(GL_SAMPLES_PASSED);
+				chunk.queryIssued = true;
+			}
+		}
+		else {
+			// Tests the box against what has been drawn so far without writing anything
+			if (!chunk.queryIssued) {
+				glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+				glDepthMask(GL_FALSE);
+				pglBeginQuery(GL_SAMPLES_PASSED, chunk.query);
+				drawChunkBox(chunk);
+				pglEndQuery(GL_SAMPLES_PASSED);
+				glDepthMask(GL_TRUE);
+				glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+				chunk.queryIssued = true;
+			}
+			occlusionSkipped++;
+		}
+	}
+
+	// Reports the skipped chunks once a second
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	if (now - occlusionReportTime > std::chrono::seconds(1)) {
+		printf("Occlusion culling: %zu of %zu chunks skipped\n", occlusionSkipped, meshChunks.size());
+		occlusionReportTime = now;
+	}
 }
 
 /*********************************************************************************************
@@ -411,11 +1324,86 @@ void draw_axes() {
 	glEnd();
 }
 
-void draw_triangular_obj(bool load) {
+// Sends one lit triangle of triVertexIndices, called between glBegin(GL_TRIANGLES) and glEnd
+void emitTriangleFace(int i) {
+	// Creates a new array to hold the vertex indices of the current face.
+	std::array<int, 3> face = triVertexIndices[i];
+	// Uses the indices array to index the vertices array and get the coordinates
+	// of each vertex
+	std::array<float, 3> v1 = vertices[face[0] - 1];
+	std::array<float, 3> v2 = vertices[face[1] - 1];
+	std::array<float, 3> v3 = vertices[face[2] - 1];
+
+	// Sets the material colour to blue
+	glColor3f(0.0f, 0.0f, 1.0f);
+	// Sets the normal variable to be the result of the calcNormal function on
+	// 3 adjacent vertices
+	std::array<float, 3> normal = calcNormal(v1, v2, v3);
+	// Sets the coordinates of the normal variable as the normal of the current face
+	glNormal3f(normal[0], normal[1], normal[2]);
+	// Plots the 3 vertices of the face
+	glVertex3f(v1[0], v1[1], v1[2]);
+	glVertex3f(v2[0], v2[1], v2[2]);
+	glVertex3f(v3[0], v3[1], v3[2]);
+}
+
+// Sends one lit, textured quad of quadVertexIndices, called between glBegin(GL_QUADS) and glEnd
+void emitQuadFace(int i) {
+	// An nested array that holds the texture coordinates of each face of the cube texture
+	static const float cubeTexCoords[6][8] = {
+		{ 0.00f,  0.00f     , 0.25f,  0.00f     , 0.25f, (1.0f/3.0f), 0.00f, (1.0f/3.0f) },
+		{ 0.00f, (1.0f/3.0f), 0.25f, (1.0f/3.0f), 0.25f, (2.0f/3.0f), 0.00f, (2.0f/3.0f) },
+		{ 0.00f, (2.0f/3.0f), 0.25f, (2.0f/3.0f), 0.25f,  1.00f     , 0.00f,  1.00f      },
+		{ 0.25f, (1.0f/3.0f), 0.50f, (1.0f/3.0f), 0.50f, (2.0f/3.0f), 0.25f, (2.0f/3.0f) },
+		{ 0.50f, (1.0f/3.0f), 0.75f, (1.0f/3.0f), 0.75f, (2.0f/3.0f), 0.50f, (2.0f/3.0f) },
+		{ 0.75f, (1.0f/3.0f), 1.00f, (1.0f/3.0f), 1.00f, (2.0f/3.0f), 0.75f, (2.0f/3.0f) }
+	};
+
+	// Creates a new array to hold the vertex indices of the current face.
+	std::array<int, 4> face = quadVertexIndices[i];
+	// Uses the indices array to index the vertices array and get the coordinates
+	// of each vertex
+	std::array<float, 3> v1 = vertices[face[0] - 1];
+	std::array<float, 3> v2 = vertices[face[1] - 1];
+	std::array<float, 3> v3 = vertices[face[2] - 1];
+	std::array<float, 3> v4 = vertices[face[3] - 1];
+
+	// Sets the base colour as white
+	glColor3f(1.0f, 1.0f, 1.0f);
+	// Sets the normal variable to be the result of the calcNormal function on
+	// 3 adjacent vertices
+	std::array<float, 3> normal = calcNormal(v1, v2, v3);
+	// A quad whose first half collapsed when welding, e.g. (a, a, b, c), takes the normal of
+	// its other half instead of a zero normal
+	if (normal[0] == 0.0f && normal[1] == 0.0f && normal[2] == 0.0f) {
+		normal = calcNormal(v1, v3, v4);
+	}
+	// Sets the coordinates of the normal variable as the normal of the current face
+	glNormal3f(normal[0], normal[1], normal[2]);
+
+	// Uses the above texture coordinates for the cube and uses other coordinates for
+	// the elephant.
+	if (renderobj == '1' && i < 6) {
+		// Sets the texture for each vertex of the cube faces
+		glTexCoord2f(cubeTexCoords[i][0], cubeTexCoords[i][1]); glVertex3f(v1[0], v1[1], v1[2]);
+		glTexCoord2f(cubeTexCoords[i][2], cubeTexCoords[i][3]); glVertex3f(v2[0], v2[1], v2[2]);
+		glTexCoord2f(cubeTexCoords[i][4], cubeTexCoords[i][5]); glVertex3f(v3[0], v3[1], v3[2]);
+		glTexCoord2f(cubeTexCoords[i][6], cubeTexCoords[i][7]); glVertex3f(v4[0], v4[1], v4[2]);
+	}
+	else {
+		// Sets the texture for each vertex of the elephant faces
+		glTexCoord2f(0.0f, 0.0f); glVertex3f(v1[0], v1[1], v1[2]);
+		glTexCoord2f(0.0f, 1.0f); glVertex3f(v2[0], v2[1], v2[2]);
+		glTexCoord2f(1.0f, 1.0f); glVertex3f(v3[0], v3[1], v3[2]);
+		glTexCoord2f(1.0f, 0.0f); glVertex3f(v4[0], v4[1], v4[2]);
+	}
+}
+
+void draw_triangular_obj(bool load, char mode) {
 	if (!load) {
 		exit(39);
 	}
-	switch (rendermode) {
+	switch (mode) {
 		case 'v':
 		{
 			// Draw points
@@ -475,36 +1463,22 @@ void draw_triangular_obj(bool load) {
 			glEnable(GL_LIGHTING);
 			glEnable(GL_LIGHT0);
 
-			// Array to hold the normal of the current face
-			std::array<float, 3> normal;
-			// Triangles not quads
-			glBegin(GL_TRIANGLES);
-			int i = 0;
-
-			// Iterates over the triVertexIndices array to get each face
-			while (i < triVertexIndices.size()) {
-				// Creates a new array to hold the vertex indices of the current face.
-				std::array<int, 3> face = triVertexIndices[i];
-				// Uses the indices array to index the vertices array and get the coordinates
-				// of each vertex
-				std::array<float, 3> v1 = vertices[face[0] - 1];
-				std::array<float, 3> v2 = vertices[face[1] - 1];
-				std::array<float, 3> v3 = vertices[face[2] - 1];
-
-				// Sets the material colour to blue
-				glColor3f(0.0f, 0.0f, 1.0f);
-				// Sets the normal variable to be the result of the calcNormal function on
-				// 3 adjacent vertices
-				normal = calcNormal(v1, v2, v3);
-				// Sets the coordinates of the normal variable as the normal of the current face
-				glNormal3f(normal[0], normal[1], normal[2]);
-				// Plots the 3 vertices of the face
-				glVertex3f(v1[0], v1[1], v1[2]);
-				glVertex3f(v2[0], v2[1], v2[2]);
-				glVertex3f(v3[0], v3[1], v3[2]);
-				i += 1;
+			// Draws the visible chunks only when occlusion culling is on
+			if (occlusionCulling && hasOcclusionQueries) {
+				drawChunksOccluded(GL_TRIANGLES, emitTriangleFace);
+			}
+			else {
+				// Triangles not quads
+				glBegin(GL_TRIANGLES);
+				int i = 0;
+
+				// Iterates over the triVertexIndices array to get each face
+				while (i < triVertexIndices.size()) {
+					emitTriangleFace(i);
+					i += 1;
+				}
+				glEnd();
 			}
-			glEnd();
 
 			// Disable Lighting
 			glDisable(GL_LIGHTING);
@@ -514,11 +1488,11 @@ void draw_triangular_obj(bool load) {
 	}
 }
 
-void draw_quad_obj(bool load) {
+void draw_quad_obj(bool load, char mode) {
 	if (!load) {
 		exit(39);
 	}
-	switch (rendermode) {
+	switch (mode) {
 		case 'v':
 		{
 			// Draw points
@@ -580,63 +1554,25 @@ void draw_quad_obj(bool load) {
 
 		case 'f':
 		{
-			// An nested array that holds the texture coordinates of each face of the cube texture
-			std::array<std::array<float, 8>, 6> cubeTexCoords;
-			cubeTexCoords[0] = { 0.00f,  0.00f     , 0.25f,  0.00f     , 0.25f, (1.0f/3.0f), 0.00f, (1.0f/3.0f) };
-			cubeTexCoords[1] = { 0.00f, (1.0f/3.0f), 0.25f, (1.0f/3.0f), 0.25f, (2.0f/3.0f), 0.00f, (2.0f/3.0f) };
-			cubeTexCoords[2] = { 0.00f, (2.0f/3.0f), 0.25f, (2.0f/3.0f), 0.25f,  1.00f     , 0.00f,  1.00f      };
-			cubeTexCoords[3] = { 0.25f, (1.0f/3.0f), 0.50f, (1.0f/3.0f), 0.50f, (2.0f/3.0f), 0.25f, (2.0f/3.0f) };
-			cubeTexCoords[4] = { 0.50f, (1.0f/3.0f), 0.75f, (1.0f/3.0f), 0.75f, (2.0f/3.0f), 0.50f, (2.0f/3.0f) };
-			cubeTexCoords[5] = { 0.75f, (1.0f/3.0f), 1.00f, (1.0f/3.0f), 1.00f, (2.0f/3.0f), 0.75f, (2.0f/3.0f) };
-
 			// Enable Lighting and Textures
 			glEnable(GL_LIGHTING);
 			glEnable(GL_LIGHT0);
 			glEnable(GL_TEXTURE_2D);
 
-			// Array to hold the normal of the current face
-			std::array<float, 3> normal;
-			glBegin(GL_QUADS);
-			int i = 0;
-			// Iterates over the quadVertexIndices array to get each face
-			while (i < quadVertexIndices.size()) {
-				// Creates a new array to hold the vertex indices of the current face.
-				std::array<int, 4> face = quadVertexIndices[i];
-				// Uses the indices array to index the vertices array and get the coordinates
-				// of each vertex
-				std::array<float, 3> v1 = vertices[face[0] - 1];
-				std::array<float, 3> v2 = vertices[face[1] - 1];
-				std::array<float, 3> v3 = vertices[face[2] - 1];
-				std::array<float, 3> v4 = vertices[face[3] - 1];
-
-				// Sets the base colour as white
-				glColor3f(1.0f, 1.0f, 1.0f);
-				// Sets the normal variable to be the result of the calcNormal function on
-				// 3 adjacent vertices
-				normal = calcNormal(v1, v2, v3);
-				// Sets the coordinates of the normal variable as the normal of the current face
-				glNormal3f(normal[0], normal[1], normal[2]);
-
-				// Uses the above texture coordinates for the cube and uses other coordinates for
-				// the elephant.
-				if (renderobj == '1') {
-					// Sets the texture for each vertex of the cube faces
-					glTexCoord2f(cubeTexCoords[i][0], cubeTexCoords[i][1]); glVertex3f(v1[0], v1[1], v1[2]);
-					glTexCoord2f(cubeTexCoords[i][2], cubeTexCoords[i][3]); glVertex3f(v2[0], v2[1], v2[2]);
-					glTexCoord2f(cubeTexCoords[i][4], cubeTexCoords[i][5]); glVertex3f(v3[0], v3[1], v3[2]);
-					glTexCoord2f(cubeTexCoords[i][6], cubeTexCoords[i][7]); glVertex3f(v4[0], v4[1], v4[2]);
-				}
-				else {
-					// Sets the texture for each vertex of the elephant faces
-					glTexCoord2f(0.0f, 0.0f); glVertex3f(v1[0], v1[1], v1[2]);
-					glTexCoord2f(0.0f, 1.0f); glVertex3f(v2[0], v2[1], v2[2]);
-					glTexCoord2f(1.0f, 1.0f); glVertex3f(v3[0], v3[1], v3[2]);
-					glTexCoord2f(1.0f, 0.0f); glVertex3f(v4[0], v4[1], v4[2]);
+			// Draws the visible chunks only when occlusion culling is on
+			if (occlusionCulling && hasOcclusionQueries) {
+				drawChunksOccluded(GL_QUADS, emitQuadFace);
+			}
+			else {
+				glBegin(GL_QUADS);
+				int i = 0;
+				// Iterates over the quadVertexIndices array to get each face
+				while (i < quadVertexIndices.size()) {
+					emitQuadFace(i);
+					i += 1;
 				}
-
-				i += 1;
+				glEnd();
 			}
-			glEnd();
 
 			// Disable Lighting and Textures for other objects/render modes
 			glDisable(GL_LIGHTING);
@@ -648,50 +1584,2789 @@ void draw_quad_obj(bool load) {
 }
 
 /*********************************************************************************************
-	LOAD OBJECTS
+	MEMORY
 *********************************************************************************************/
-// Load Cube Object
-void cube() {
-	renderobj  = '1';
-	// Clears the global vector arrays to hold new data
-	vertices.clear();
-	quadVertexIndices.clear();
-	// Uses the cubeobjloader header to load the vertex data from the cube.obj file
-	loadCube = load_cube_obj("cube3.obj", vertices, quadVertexIndices);
-	// Loads the texture for the cube object
-	texture =  LoadTexture( "dice.bmp" );
+
+// Heap allocations made through operator new while a thread is loading an object. Each thread
+// has its own counters and only counts between beginLoadStats and endLoadStats, so the render,
+// capture and watcher threads never add to a load's numbers.
+thread_local bool countingAllocations = false;
+thread_local size_t allocationCount = 0;
+thread_local size_t allocationBytes = 0;
+
+// Both are kept out of line, otherwise GCC sees malloc() paired with operator delete, or
+// operator new paired with free(), and warns. The sized and array forms all end up here.
+#ifdef __GNUC__
+#define ALLOCATOR_NOINLINE __attribute__((noinline))
+#else
+#define ALLOCATOR_NOINLINE
+#endif
+
+ALLOCATOR_NOINLINE void * operator new(size_t size) {
+	if (countingAllocations) {
+		allocationCount++;
+		allocationBytes += size;
+	}
+	void * p = malloc(size > 0 ? size : 1);
+	if (p == NULL) {
+		throw std::bad_alloc();
+	}
+	return p;
 }
 
-// Load Bunny Object
-void bunny() {
-	renderobj  = '2';
-	// Clears the global vector arrays to hold new data
-	vertices.clear();
-	triVertexIndices.clear();
-	// Uses the objloader header to load the vertex data from the bunny.obj file
-	loadBunny = load_obj("bunny.obj", vertices, triVertexIndices);
+ALLOCATOR_NOINLINE void operator delete(void * p) noexcept {
+	free(p);
 }
 
-// Load Screwdriver Object
-void screwdriver() {
-	renderobj  = '3';
-	// Clears the global vector arrays to hold new data
-	vertices.clear();
-	triVertexIndices.clear();
-	// Uses the objloader header to load the vertex data from the screwdriver.obj file
-	loadSD = load_obj("screwdriver.obj", vertices, triVertexIndices);
+// Returns the resident set size of the process in KB, 0 where it can't be read
+size_t currentRSS() {
+#ifdef __linux__
+	FILE * file = fopen("/proc/self/statm", "r");
+	long size = 0, pages = 0;
+	if (file != NULL) {
+		if (fscanf(file, "%ld %ld", &size, &pages) != 2) pages = 0;
+		fclose(file);
+	}
+	return (size_t)pages * (size_t)sysconf(_SC_PAGESIZE) / 1024;
+#else
+	return 0;
+#endif
 }
 
-// Load Elephant Object
-void elephant() {
-	renderobj  = '4';
-	// Clears the global vector arrays to hold new data
-	vertices.clear();
-	quadVertexIndices.clear();
-	// Uses the cubeobjloader header to load the vertex data from the elephant3.obj file
-	loadElephant = load_cube_obj("elephant3.obj", vertices, quadVertexIndices);
-	// Loads the texture for the elephant object
-	texture =  LoadTexture( "yarn2.bmp" );
+// Returns the highest resident set size the process has reached in KB
+size_t peakRSS() {
+#ifndef _WIN32
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+	return (size_t)usage.ru_maxrss / 1024;
+#else
+	return (size_t)usage.ru_maxrss;
+#endif
+#else
+	return 0;
+#endif
+}
+
+// Counters of a load
+struct LoadStats {
+	std::chrono::steady_clock::time_point start;
+	size_t allocations;  // Made by the loading thread, set by endLoadStats
+	size_t bytes;
+	size_t peakBefore;
+};
+
+// Starts counting the allocations of the calling thread
+LoadStats beginLoadStats() {
+	LoadStats stats;
+	stats.start = std::chrono::steady_clock::now();
+	stats.allocations = 0;
+	stats.bytes = 0;
+	stats.peakBefore = peakRSS();
+	allocationCount = 0;
+	allocationBytes = 0;
+	countingAllocations = true;
+	return stats;
+}
+
+// Stops counting, called on the same thread as beginLoadStats
+void endLoadStats(LoadStats &stats) {
+	countingAllocations = false;
+	stats.allocations = allocationCount;
+	stats.bytes = allocationBytes;
+}
+
+// Prints the time a load took, its allocations, the memory held by the loaded arrays and the
+// process memory
+void printLoadStats(const char * filename, const LoadStats &stats, size_t meshBytes) {
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - stats.start).count();
+	size_t peak = peakRSS();
+	printf("%s: loaded in %.1f ms, %zu allocations of %zu KB, %zu KB of mesh arrays, RSS %zu KB, peak %zu KB (+%zu KB)\n",
+		filename, ms, stats.allocations, stats.bytes / 1024, meshBytes / 1024, currentRSS(), peak, peak - stats.peakBefore);
+}
+
+// Counts the "v" and "f" lines of an OBJ file, reading it in large blocks
+void countObjElements(const char * filename, size_t &vertexCount, size_t &faceCount) {
+	vertexCount = 0;
+	faceCount = 0;
+	FILE * file = fopen(filename, "rb");
+	if (file == NULL) {
+		return;
+	}
+
+	std::vector<char> buffer(1 << 16);
+	int column = 0;
+	char first = 0;
+	size_t n;
+	while ((n = fread(buffer.data(), 1, buffer.size(), file)) > 0) {
+		for (size_t i = 0; i < n; i++) {
+			char c = buffer[i];
+			if (c == '\n') {
+				column = 0;
+				continue;
+			}
+			if (column == 0) {
+				first = c;
+			}
+			else if (column == 1 && (c == ' ' || c == '\t')) {
+				if (first == 'v') vertexCount++;
+				else if (first == 'f') faceCount++;
+			}
+			column = std::min(column + 1, 2);
+		}
+	}
+	fclose(file);
+}
+
+// Sizes the arrays for an OBJ file before the loader fills them, so they are allocated once
+// instead of regrowing and copying on every power of two
+template <size_t N>
+void reserveForObj(const char * filename, std::vector<std::array<float, 3>> &points, std::vector<std::array<int, N>> &faces) {
+	size_t vertexCount, faceCount;
+	countObjElements(filename, vertexCount, faceCount);
+	points.reserve(vertexCount);
+	faces.reserve(faceCount);
+}
+
+/*********************************************************************************************
+	MESH CLEANUP
+*********************************************************************************************/
+
+// Holds what the cleanup pass removed from a loaded object
+struct CleanupStats {
+	size_t verticesBefore;
+	size_t verticesAfter;
+	size_t facesBefore;
+	size_t degenerateFaces;
+	size_t duplicateFaces;
+	size_t bytesBefore;
+	size_t bytesAfter;
+	size_t arenaBytes;   // Memory the pass took for its temporary arrays
+	size_t arenaBlocks;  // Number of blocks it came in
+};
+
+// Memory resource that counts what it hands out, used under the load arena
+class CountingResource : public std::pmr::memory_resource {
+public:
+	size_t bytes = 0;
+	size_t blocks = 0;
+
+private:
+	void * do_allocate(size_t size, size_t alignment) override {
+		bytes += size;
+		blocks += 1;
+		return std::pmr::new_delete_resource()->allocate(size, alignment);
+	}
+	void do_deallocate(void * p, size_t size, size_t alignment) override {
+		std::pmr::new_delete_resource()->deallocate(p, size, alignment);
+	}
+	bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+		return this == &other;
+	}
+};
+
+// Returns the number of bytes held by a vertex array and a face array
+template <size_t N>
+size_t meshBytes(const std::vector<std::array<float, 3>> &points, const std::vector<std::array<int, N>> &faces) {
+	return points.capacity() * sizeof(std::array<float, 3>) + faces.capacity() * sizeof(std::array<int, N>);
+}
+
+// Returns the length of the cross product of (b - a) and (c - a), twice the triangle area
+float triangleArea2(const std::array<float, 3> &a, const std::array<float, 3> &b, const std::array<float, 3> &c) {
+	std::array<float, 3> cross;
+	cross[0] = ((b[1] - a[1]) * (c[2] - a[2])) - ((b[2] - a[2]) * (c[1] - a[1]));
+	cross[1] = ((b[2] - a[2]) * (c[0] - a[0])) - ((b[0] - a[0]) * (c[2] - a[2]));
+	cross[2] = ((b[0] - a[0]) * (c[1] - a[1])) - ((b[1] - a[1]) * (c[0] - a[0]));
+	return vectorLength(cross);
+}
+
+// Packs the integer coordinates of a spatial hash cell into a single key. Cells that alias
+// onto the same key only share a bucket, the distance test keeps the weld correct.
+long long weldCellKey(long long x, long long y, long long z) {
+	return ((x & 0x1FFFFF) << 42) | ((y & 0x1FFFFF) << 21) | (z & 0x1FFFFF);
+}
+
+// Merges all vertices that lie within epsilon of an earlier vertex. The points array is
+// replaced by the welded vertices and the returned array maps each old index to its new one.
+// The spatial hash and remap are allocated from the load's arena.
+std::pmr::vector<int> weldVertices(std::vector<std::array<float, 3>> &points, float epsilon, std::pmr::memory_resource * arena) {
+	std::pmr::vector<int> remap(points.size(), arena);
+	std::pmr::vector<std::array<float, 3>> welded(arena);
+	welded.reserve(points.size());
+
+	// Spatial hash of cells one epsilon wide, so any match lies in one of the 27 neighbouring cells
+	std::pmr::unordered_map<long long, std::pmr::vector<int>> grid(arena);
+	grid.reserve(points.size());
+	float epsilon2 = epsilon * epsilon;
+
+	for (size_t i = 0; i < points.size(); i++) {
+		std::array<float, 3> p = points[i];
+		long long cell[3];
+		for (int k = 0; k < 3; k++) {
+			cell[k] = (long long)floor(p[k] / epsilon);
+		}
+
+		// Searches the neighbouring cells for an already welded vertex
+		int match = -1;
+		for (int dx = -1; dx <= 1 && match < 0; dx++) {
+			for (int dy = -1; dy <= 1 && match < 0; dy++) {
+				for (int dz = -1; dz <= 1 && match < 0; dz++) {
+					auto bucket = grid.find(weldCellKey(cell[0] + dx, cell[1] + dy, cell[2] + dz));
+					if (bucket == grid.end()) {
+						continue;
+					}
+					for (int candidate : bucket->second) {
+						std::array<float, 3> q = welded[candidate];
+						float d2 = (p[0] - q[0]) * (p[0] - q[0]) + (p[1] - q[1]) * (p[1] - q[1]) + (p[2] - q[2]) * (p[2] - q[2]);
+						if (d2 <= epsilon2) {
+							match = candidate;
+							break;
+						}
+					}
+				}
+			}
+		}
+
+		// No vertex close enough, so this one is kept
+		if (match < 0) {
+			match = (int)welded.size();
+			welded.push_back(p);
+			grid[weldCellKey(cell[0], cell[1], cell[2])].push_back(match);
+		}
+		remap[i] = match;
+	}
+
+	// Copies into an array of exactly the welded size, the only allocation that outlives the load
+	std::vector<std::array<float, 3>> exact(welded.begin(), welded.end());
+	points.swap(exact);
+	return remap;
+}
+
+// Rewrites the 1-based face indices through the weld remap, splitting the faces across threads.
+// Indices that point outside the vertex array are set to 0 so the face is dropped as degenerate.
+template <size_t N>
+void remapFaces(std::vector<std::array<int, N>> &faces, const std::pmr::vector<int> &remap) {
+	unsigned int threads = std::max(1u, std::thread::hardware_concurrency());
+	size_t block = (faces.size() + threads - 1) / threads;
+	std::vector<std::thread> workers;
+
+	for (unsigned int t = 0; t < threads; t++) {
+		size_t begin = t * block;
+		size_t end = std::min(faces.size(), begin + block);
+		if (begin >= end) {
+			break;
+		}
+		workers.emplace_back([&faces, &remap, begin, end]() {
+			for (size_t f = begin; f < end; f++) {
+				for (size_t k = 0; k < N; k++) {
+					int index = faces[f][k];
+					faces[f][k] = (index >= 1 && index <= (int)remap.size()) ? remap[index - 1] + 1 : 0;
+				}
+			}
+		});
+	}
+
+	for (size_t t = 0; t < workers.size(); t++) {
+		workers[t].join();
+	}
+}
+
+// Returns true if a face has invalid indices, fewer than 3 distinct vertices or no area
+template <size_t N>
+bool isDegenerate(const std::vector<std::array<float, 3>> &points, const std::array<int, N> &face) {
+	float minArea = std::numeric_limits<float>::min();
+	for (size_t k = 0; k < N; k++) {
+		if (face[k] == 0) {
+			return true;
+		}
+	}
+
+	// Triangle (or first half of a quad)
+	float area = triangleArea2(points[face[0] - 1], points[face[1] - 1], points[face[2] - 1]);
+	// Second half of a quad
+	if (N == 4) {
+		area += triangleArea2(points[face[0] - 1], points[face[2] - 1], points[face[N - 1] - 1]);
+	}
+	return area < minArea;
+}
+
+// Welds vertices, then drops degenerate and duplicate faces while keeping the order of the
+// remaining faces (the cube texture coordinates depend on it).
+template <size_t N>
+CleanupStats cleanMesh(std::vector<std::array<float, 3>> &points, std::vector<std::array<int, N>> &faces) {
+	CleanupStats stats = {};
+	stats.verticesBefore = points.size();
+	stats.facesBefore = faces.size();
+	stats.bytesBefore = meshBytes(points, faces);
+
+	// Arena for everything the pass needs only while it runs, released in one go at the end.
+	// The first block is sized from the input so most loads need only one.
+	CountingResource upstream;
+	std::pmr::monotonic_buffer_resource arena(points.size() * 96 + faces.size() * (sizeof(std::array<int, N>) + 24), &upstream);
+
+	std::pmr::vector<int> remap = weldVertices(points, weldEpsilon, &arena);
+	remapFaces(faces, remap);
+
+	// Flags faces to remove, 1 = degenerate, 2 = duplicate
+	std::pmr::vector<char> remove(faces.size(), 0, &arena);
+	for (size_t f = 0; f < faces.size(); f++) {
+		if (isDegenerate(points, faces[f])) {
+			remove[f] = 1;
+		}
+	}
+
+	// Faces using the same set of vertices are duplicates whatever their winding, so sorting the
+	// sorted index sets brings them next to each other. The earliest face is kept.
+	std::pmr::vector<std::pair<std::array<int, N>, size_t>> keys(&arena);
+	keys.reserve(faces.size());
+	for (size_t f = 0; f < faces.size(); f++) {
+		if (remove[f] == 0) {
+			std::array<int, N> key = faces[f];
+			std::sort(key.begin(), key.end());
+			keys.push_back(std::make_pair(key, f));
+		}
+	}
+	std::sort(keys.begin(), keys.end());
+	for (size_t i = 1; i < keys.size(); i++) {
+		if (keys[i].first == keys[i - 1].first) {
+			remove[keys[i].second] = 2;
+		}
+	}
+
+	// Compacts the face array in place
+	size_t kept = 0;
+	for (size_t f = 0; f < faces.size(); f++) {
+		if (remove[f] == 0) {
+			faces[kept++] = faces[f];
+		}
+		else if (remove[f] == 1) {
+			stats.degenerateFaces++;
+		}
+		else {
+			stats.duplicateFaces++;
+		}
+	}
+	faces.resize(kept);
+
+	// Gives the removed memory back. The welded points are already exactly sized.
+	faces.shrink_to_fit();
+
+	stats.verticesAfter = points.size();
+	stats.bytesAfter = meshBytes(points, faces);
+	stats.arenaBytes = upstream.bytes;
+	stats.arenaBlocks = upstream.blocks;
+	return stats;
+}
+
+// Prints what the cleanup pass removed from an object
+void printCleanupStats(const char * filename, const CleanupStats &stats) {
+	printf("%s: welded %zu -> %zu vertices, removed %zu degenerate and %zu duplicate of %zu faces, %zu -> %zu bytes"
+		" (%zu byte arena in %zu blocks)\n",
+		filename, stats.verticesBefore, stats.verticesAfter, stats.degenerateFaces, stats.duplicateFaces,
+		stats.facesBefore, stats.bytesBefore, stats.bytesAfter, stats.arenaBytes, stats.arenaBlocks);
+}
+
+/*********************************************************************************************
+	HOT RELOAD
+*********************************************************************************************/
+
+// An asset re-parsed by the watcher thread, waiting for the render thread to apply it
+struct AssetReload {
+	std::string filename;
+	bool isTexture;
+	bool quads;
+	std::vector<std::array<float, 3>> vertices;
+	std::vector<std::array<int, 3>> triVertexIndices;
+	std::vector<std::array<int, 4>> quadVertexIndices;
+	std::vector<unsigned char> pixels;
+	std::chrono::steady_clock::time_point changed;  // When the file change was seen
+};
+
+// Files of the current object, read by the watcher thread
+std::mutex watchMutex;
+std::string watchedObj;
+std::string watchedTexture;
+bool watchedQuads = false;
+
+// Finished reloads, handed over under reloadMutex
+std::mutex reloadMutex;
+std::vector<AssetReload> pendingReloads;
+std::vector<std::string> staleAssets;  // Changed files of objects in the resident store
+
+std::atomic<bool> watcherRunning(false);
+std::thread watcherThread;
+
+// Tells the watcher which files belong to the object that was just loaded
+void setWatchedAssets(const char * obj, const char * bmp, bool quads) {
+	std::lock_guard<std::mutex> lock(watchMutex);
+	watchedObj = obj;
+	watchedTexture = bmp != NULL ? bmp : "";
+	watchedQuads = quads;
+}
+
+// Returns true for the OBJ and BMP files objects are loaded from
+bool isAssetFile(const std::string &filename) {
+	size_t dot = filename.rfind('.');
+	std::string extension = dot == std::string::npos ? "" : filename.substr(dot);
+	return extension == ".obj" || extension == ".bmp";
+}
+
+// Parses a changed asset on the watcher thread and queues it for the render thread
+void reparseAsset(const std::string &filename, std::chrono::steady_clock::time_point changed) {
+	AssetReload reload;
+	reload.filename = filename;
+	reload.changed = changed;
+	{
+		std::lock_guard<std::mutex> lock(watchMutex);
+		if (filename == watchedTexture) {
+			reload.isTexture = true;
+		}
+		else if (filename == watchedObj) {
+			reload.isTexture = false;
+		}
+		else {
+			// Marks OBJ and BMP files of stored objects so they are loaded again when selected
+			if (isAssetFile(filename)) {
+				std::lock_guard<std::mutex> reloadLock(reloadMutex);
+				if (std::find(staleAssets.begin(), staleAssets.end(), filename) == staleAssets.end()) {
+					staleAssets.push_back(filename);
+				}
+			}
+			return;
+		}
+		reload.quads = watchedQuads;
+	}
+
+	bool loaded;
+	if (reload.isTexture) {
+		loaded = readBMP(filename.c_str(), reload.pixels);
+	}
+	else if (reload.quads) {
+		reserveForObj(filename.c_str(), reload.vertices, reload.quadVertexIndices);
+		loaded = load_cube_obj(filename.c_str(), reload.vertices, reload.quadVertexIndices);
+		if (loaded) printCleanupStats(filename.c_str(), cleanMesh(reload.vertices, reload.quadVertexIndices));
+	}
+	else {
+		reserveForObj(filename.c_str(), reload.vertices, reload.triVertexIndices);
+		loaded = load_obj(filename.c_str(), reload.vertices, reload.triVertexIndices);
+		if (loaded) printCleanupStats(filename.c_str(), cleanMesh(reload.vertices, reload.triVertexIndices));
+	}
+	if (!loaded) {
+		printf("Could not reload %s\n", filename.c_str());
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(reloadMutex);
+	pendingReloads.push_back(std::move(reload));
+}
+
+// Copies the elements of source that differ from target into target. If the sizes differ the
+// whole array is replaced. Returns the number of elements copied and counts the changed ranges.
+template <typename T>
+size_t applyChangedRanges(std::vector<T> &target, std::vector<T> &source, size_t &ranges) {
+	if (target.size() != source.size()) {
+		target.swap(source);
+		ranges = target.empty() ? 0 : 1;
+		return target.size();
+	}
+
+	size_t copied = 0;
+	size_t i = 0;
+	ranges = 0;
+	while (i < source.size()) {
+		if (source[i] == target[i]) {
+			i++;
+			continue;
+		}
+		size_t start = i;
+		while (i < source.size() && !(source[i] == target[i])) {
+			i++;
+		}
+		std::copy(source.begin() + start, source.begin() + i, target.begin() + start);
+		copied += i - start;
+		ranges++;
+	}
+	return copied;
+}
+
+// Uploads the rows of the current texture that differ from pixels. The mipmaps are rebuilt
+// by the driver from the new rows, or for a compressed texture only the blocks covering them
+// are encoded again.
+void applyTextureReload(std::vector<unsigned char> &pixels) {
+	int rowBytes = textureSize * 3;
+	int first = textureSize;
+	int last = -1;
+	for (int y = 0; y < textureSize; y++) {
+		if (texturePixels.size() != pixels.size() ||
+			memcmp(&texturePixels[y * rowBytes], &pixels[y * rowBytes], rowBytes) != 0) {
+			first = std::min(first, y);
+			last = y;
+		}
+	}
+	if (last < 0) {
+		printf("Texture unchanged\n");
+		return;
+	}
+
+	if (!textureBlocks.levels.empty()) {
+		recompressTextureRows(pixels, first, last);
+	}
+	else {
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_GENERATE_MIPMAP, GL_TRUE);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, first, textureSize, last - first + 1, GL_RGB, GL_UNSIGNED_BYTE,
+			&pixels[first * rowBytes]);
+	}
+	texturePixels.swap(pixels);
+	printf("Texture rows %d-%d re-uploaded\n", first, last);
+}
+
+// Render thread - applies finished reloads to the resident object. Never waits on the watcher.
+void applyPendingReloads() {
+	std::vector<AssetReload> reloads;
+	{
+		std::unique_lock<std::mutex> lock(reloadMutex, std::try_to_lock);
+		if (!lock.owns_lock() || pendingReloads.empty()) {
+			return;
+		}
+		reloads.swap(pendingReloads);
+	}
+
+	for (size_t r = 0; r < reloads.size(); r++) {
+		AssetReload &reload = reloads[r];
+		// Skips assets of an object that was switched away from while it was being parsed
+		{
+			std::lock_guard<std::mutex> lock(watchMutex);
+			if (reload.filename != (reload.isTexture ? watchedTexture : watchedObj)) {
+				continue;
+			}
+		}
+
+		if (reload.isTexture) {
+			applyTextureReload(reload.pixels);
+		}
+		else {
+			size_t vertexRanges, faceRanges;
+			size_t vertexCount = applyChangedRanges(vertices, reload.vertices, vertexRanges);
+			size_t faceCount = reload.quads
+				? applyChangedRanges(quadVertexIndices, reload.quadVertexIndices, faceRanges)
+				: applyChangedRanges(triVertexIndices, reload.triVertexIndices, faceRanges);
+			printf("%s: %zu vertices in %zu ranges and %zu faces in %zu ranges updated\n",
+				reload.filename.c_str(), vertexCount, vertexRanges, faceCount, faceRanges);
+			if (vertexCount > 0 || faceCount > 0) {
+				rebuildMeshChunks();
+			}
+		}
+
+		double latency = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - reload.changed).count();
+		printf("%s reloaded %.1f ms after the change\n", reload.filename.c_str(), latency);
+	}
+}
+
+#ifdef __linux__
+// Watches the working directory with inotify. Editors often save in several writes or by
+// renaming a temporary file, so changes are collected for a short moment before re-parsing.
+void watchAssets() {
+	int fd = inotify_init1(IN_NONBLOCK);
+	if (fd < 0 || inotify_add_watch(fd, ".", IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		printf("Asset hot reload unavailable\n");
+		return;
+	}
+
+	std::vector<std::string> changed;
+	std::chrono::steady_clock::time_point firstChange;
+	std::chrono::steady_clock::time_point lastChange;
+	const std::chrono::milliseconds settleTime(30);
+	alignas(struct inotify_event) char buffer[4096];
+
+	while (watcherRunning.load()) {
+		struct pollfd pfd = { fd, POLLIN, 0 };
+		int ready = poll(&pfd, 1, changed.empty() ? 100 : (int)settleTime.count());
+
+		if (ready > 0) {
+			ssize_t length;
+			while ((length = read(fd, buffer, sizeof(buffer))) > 0) {
+				for (char * p = buffer; p < buffer + length; ) {
+					struct inotify_event * event = (struct inotify_event *)p;
+					// Other files, e.g. captured frames, would keep the wait from ever settling
+					if (event->len > 0 && isAssetFile(event->name)) {
+						lastChange = std::chrono::steady_clock::now();
+						if (changed.empty()) {
+							firstChange = lastChange;
+						}
+						std::string name(event->name);
+						if (std::find(changed.begin(), changed.end(), name) == changed.end()) {
+							changed.push_back(name);
+						}
+					}
+					p += sizeof(struct inotify_event) + event->len;
+				}
+			}
+		}
+		// No asset changed within the wait, so the writes have settled
+		if (!changed.empty() && std::chrono::steady_clock::now() - lastChange >= settleTime) {
+			for (size_t i = 0; i < changed.size(); i++) {
+				reparseAsset(changed[i], firstChange);
+			}
+			changed.clear();
+		}
+	}
+	close(fd);
+}
+#endif
+
+// Stops the watcher thread, registered with atexit
+void stopAssetWatcher() {
+	watcherRunning = false;
+	if (watcherThread.joinable()) {
+		watcherThread.join();
+	}
+}
+
+// Starts watching the loaded assets for changes (Linux only)
+void startAssetWatcher() {
+#ifdef __linux__
+	watcherRunning = true;
+	watcherThread = std::thread(watchAssets);
+	atexit(stopAssetWatcher);
+#endif
+}
+
+/*********************************************************************************************
+	POINT CLOUD
+*********************************************************************************************/
+
+// Header at the start of an octree file
+struct OctreeHeader {
+	char magic[8];             // "OCTREE1"
+	uint32_t chunkPoints;      // Most points stored in one node
+	uint32_t nodeCount;
+	uint64_t pointCount;
+	uint64_t nodeTableOffset;  // Offset of the node table, written after all the chunks
+};
+
+// A node of the octree. Each node stores an evenly spaced sample of the points in its box and
+// its children store the rest, so drawing a node with its ancestors gives a coarser version of
+// the cloud in that box.
+struct OctreeNode {
+	float min[3];
+	float max[3];
+	int32_t children[8];       // -1 where the octant is empty
+	uint32_t pointCount;
+	uint32_t padding;
+	uint64_t dataOffset;       // Offset of the node's chunk of points
+};
+
+// State while an octree file is being written
+struct OctreeBuilder {
+	FILE * output;
+	std::string tempPrefix;
+	int tempCount;
+	uint32_t chunkPoints;
+	uint64_t dropped;          // Points past the depth limit (nearly all duplicates)
+	std::vector<OctreeNode> nodes;
+};
+
+// A cache slot holding one node's points
+struct CloudSlot {
+	int node;                  // -1 when empty
+	bool loading;
+	unsigned int lastUsed;     // Frame the slot was last drawn in
+	unsigned int count;
+	std::vector<float> points;
+};
+
+const int maxOctreeDepth = 24;
+
+// Open point cloud file, mapped read only on POSIX and read with stdio on Windows
+OctreeHeader cloudHeader;
+std::vector<OctreeNode> cloudNodes;
+const unsigned char * cloudMapping = NULL;
+size_t cloudMappingBytes = 0;
+FILE * cloudFile = NULL;
+
+// LRU cache of node chunks, shared with the loader thread under cloudMutex
+std::vector<CloudSlot> cloudSlots;
+std::vector<int> cloudNodeSlot;   // Slot holding each node, -1 if it is not resident
+std::vector<char> cloudNodeLoading;
+std::vector<int> cloudRequests;   // Missing nodes wanted by the last frame, most important first
+unsigned int cloudFrame = 0;
+std::mutex cloudMutex;
+std::atomic<bool> cloudLoaderRunning(false);
+std::thread cloudLoaderThread;
+size_t cloudPointsDrawn = 0;
+
+// Size of a node's chunk in the file, whole pages so each chunk can be paged in and out alone
+uint64_t octreeChunkBytes(uint32_t chunkPoints) {
+	return ((uint64_t)chunkPoints * 12 + 4095) / 4096 * 4096;
+}
+
+// 64 bit file positions
+uint64_t fileTell(FILE * file) {
+#ifdef _WIN32
+	return _ftelli64(file);
+#else
+	return ftello(file);
+#endif
+}
+
+void fileSeek(FILE * file, uint64_t offset) {
+#ifdef _WIN32
+	_fseeki64(file, offset, SEEK_SET);
+#else
+	fseeko(file, offset, SEEK_SET);
+#endif
+}
+
+// Builds the node for the points in the binary file at path (and removes the file). An evenly
+// spaced sample of at most chunkPoints points is written as the node's chunk and the rest are
+// split by octant into new files that become the children. Only one block of points and the
+// chunk are held in memory at a time.
+int buildOctreeNode(OctreeBuilder &builder, const std::string &path, uint64_t count,
+	const float min[3], const float max[3], int depth) {
+	int node = (int)builder.nodes.size();
+	OctreeNode empty = {};
+	for (int k = 0; k < 3; k++) {
+		empty.min[k] = min[k];
+		empty.max[k] = max[k];
+	}
+	for (int c = 0; c < 8; c++) {
+		empty.children[c] = -1;
+	}
+	builder.nodes.push_back(empty);
+
+	bool leaf = count <= builder.chunkPoints || depth >= maxOctreeDepth;
+	uint64_t stride = leaf ? 1 : (count + builder.chunkPoints - 1) / builder.chunkPoints;
+	float mid[3] = { (min[0] + max[0]) * 0.5f, (min[1] + max[1]) * 0.5f, (min[2] + max[2]) * 0.5f };
+
+	FILE * childFiles[8] = { NULL };
+	std::string childPaths[8];
+	uint64_t childCounts[8] = { 0 };
+
+	std::vector<std::array<float, 3>> chunk;
+	chunk.reserve((size_t)std::min<uint64_t>(count, builder.chunkPoints));
+	std::vector<std::array<float, 3>> block(65536);
+
+	FILE * input = fopen(path.c_str(), "rb");
+	uint64_t read = 0;
+	size_t n;
+	while (input != NULL && (n = fread(block.data(), sizeof(block[0]), block.size(), input)) > 0) {
+		for (size_t i = 0; i < n; i++, read++) {
+			if (read % stride == 0 && chunk.size() < builder.chunkPoints) {
+				chunk.push_back(block[i]);
+			}
+			else if (leaf) {
+				builder.dropped++;
+			}
+			else {
+				int octant = (block[i][0] >= mid[0] ? 1 : 0) | (block[i][1] >= mid[1] ? 2 : 0) | (block[i][2] >= mid[2] ? 4 : 0);
+				if (childFiles[octant] == NULL) {
+					childPaths[octant] = builder.tempPrefix + std::to_string(builder.tempCount++);
+					childFiles[octant] = fopen(childPaths[octant].c_str(), "wb");
+				}
+				fwrite(&block[i], sizeof(block[i]), 1, childFiles[octant]);
+				childCounts[octant]++;
+			}
+		}
+	}
+	if (input != NULL) {
+		fclose(input);
+	}
+	remove(path.c_str());
+
+	// Writes the chunk, padded to the fixed chunk size
+	builder.nodes[node].pointCount = (uint32_t)chunk.size();
+	builder.nodes[node].dataOffset = fileTell(builder.output);
+	fwrite(chunk.data(), sizeof(chunk[0]), chunk.size(), builder.output);
+	std::vector<char> padding((size_t)(octreeChunkBytes(builder.chunkPoints) - chunk.size() * sizeof(chunk[0])), 0);
+	fwrite(padding.data(), 1, padding.size(), builder.output);
+	chunk = std::vector<std::array<float, 3>>();
+
+	for (int c = 0; c < 8; c++) {
+		if (childFiles[c] != NULL) {
+			fclose(childFiles[c]);
+		}
+	}
+	for (int c = 0; c < 8; c++) {
+		if (childCounts[c] == 0) {
+			continue;
+		}
+		float childMin[3], childMax[3];
+		for (int k = 0; k < 3; k++) {
+			bool upper = (c >> k) & 1;
+			childMin[k] = upper ? mid[k] : min[k];
+			childMax[k] = upper ? max[k] : mid[k];
+		}
+		int child = buildOctreeNode(builder, childPaths[c], childCounts[c], childMin, childMax, depth + 1);
+		builder.nodes[node].children[c] = child;
+	}
+	return node;
+}
+
+// Converts a point file to an octree file. The input is streamed, so it may be far larger than
+// memory. OBJ "v x y z" lines and plain "x y z" lines are read, everything else is skipped.
+bool buildOctree(const char * inputFile, const char * outputFile, uint32_t chunkPoints) {
+	FILE * input = fopen(inputFile, "r");
+	if (input == NULL) {
+		printf("Could not open %s\n", inputFile);
+		return false;
+	}
+
+	// First pass - copies the points to a binary file and finds the bounding box
+	OctreeBuilder builder;
+	builder.tempPrefix = std::string(outputFile) + ".tmp";
+	builder.tempCount = 0;
+	builder.chunkPoints = chunkPoints;
+	builder.dropped = 0;
+	std::string rootPath = builder.tempPrefix + std::to_string(builder.tempCount++);
+	FILE * points = fopen(rootPath.c_str(), "wb");
+	if (points == NULL) {
+		fclose(input);
+		return false;
+	}
+
+	float min[3] = { std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max() };
+	float max[3] = { -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max() };
+	uint64_t count = 0;
+	char line[512];
+	while (fgets(line, sizeof(line), input) != NULL) {
+		std::array<float, 3> p;
+		const char * values = line;
+		if (line[0] == 'v' && line[1] == ' ') {
+			values = line + 2;
+		}
+		else if (!(isdigit((unsigned char)line[0]) || line[0] == '-' || line[0] == '+' || line[0] == '.')) {
+			continue;
+		}
+		if (sscanf(values, "%f %f %f", &p[0], &p[1], &p[2]) != 3) {
+			continue;
+		}
+		for (int k = 0; k < 3; k++) {
+			min[k] = std::min(min[k], p[k]);
+			max[k] = std::max(max[k], p[k]);
+		}
+		fwrite(&p, sizeof(p), 1, points);
+		count++;
+	}
+	fclose(input);
+	fclose(points);
+	if (count == 0) {
+		printf("No points in %s\n", inputFile);
+		remove(rootPath.c_str());
+		return false;
+	}
+
+	// Makes the root box a cube, slightly larger so points on the edge are inside
+	float size = std::max(max[0] - min[0], std::max(max[1] - min[1], max[2] - min[2])) * 1.001f + 1e-6f;
+	for (int k = 0; k < 3; k++) {
+		max[k] = min[k] + size;
+	}
+
+	// Second pass - writes the chunks after a page sized header, then the node table
+	builder.output = fopen(outputFile, "wb");
+	if (builder.output == NULL) {
+		remove(rootPath.c_str());
+		return false;
+	}
+	std::vector<char> headerPage(4096, 0);
+	fwrite(headerPage.data(), 1, headerPage.size(), builder.output);
+	buildOctreeNode(builder, rootPath, count, min, max, 0);
+
+	OctreeHeader header = {};
+	memcpy(header.magic, "OCTREE1", 8);
+	header.chunkPoints = chunkPoints;
+	header.nodeCount = (uint32_t)builder.nodes.size();
+	header.pointCount = count - builder.dropped;
+	header.nodeTableOffset = fileTell(builder.output);
+	fwrite(builder.nodes.data(), sizeof(OctreeNode), builder.nodes.size(), builder.output);
+	fileSeek(builder.output, 0);
+	fwrite(&header, sizeof(header), 1, builder.output);
+	fclose(builder.output);
+
+	printf("%s: %llu points in %u nodes of up to %u points, %llu duplicate points dropped\n", outputFile,
+		(unsigned long long)header.pointCount, header.nodeCount, chunkPoints, (unsigned long long)builder.dropped);
+	return true;
+}
+
+// Copies a node's points into a cache slot. Runs on the loader thread, so page faults on the
+// mapped file never hold up a frame.
+void readCloudNode(int node, CloudSlot &slot) {
+	const OctreeNode &n = cloudNodes[node];
+	slot.points.resize((size_t)cloudHeader.chunkPoints * 3);
+	size_t bytes = (size_t)n.pointCount * 12;
+#ifdef _WIN32
+	fileSeek(cloudFile, n.dataOffset);
+	fread(slot.points.data(), 1, bytes, cloudFile);
+#else
+	memcpy(slot.points.data(), cloudMapping + n.dataOffset, bytes);
+	// The copy is cached now, so the file pages can be dropped to keep memory bounded
+	madvise((void *)(cloudMapping + n.dataOffset), (size_t)octreeChunkBytes(cloudHeader.chunkPoints), MADV_DONTNEED);
+#endif
+	slot.count = n.pointCount;
+}
+
+// Loader thread - loads the most important missing node, evicting the least recently drawn
+// slot that the current frame is not using
+void cloudLoaderLoop() {
+	while (cloudLoaderRunning.load()) {
+		int node = -1;
+		int slot = -1;
+		{
+			std::lock_guard<std::mutex> lock(cloudMutex);
+			for (size_t r = 0; r < cloudRequests.size() && node < 0; r++) {
+				if (cloudNodeSlot[cloudRequests[r]] < 0 && !cloudNodeLoading[cloudRequests[r]]) {
+					node = cloudRequests[r];
+				}
+			}
+			if (node >= 0) {
+				for (size_t s = 0; s < cloudSlots.size(); s++) {
+					CloudSlot &candidate = cloudSlots[s];
+					if (candidate.loading || (candidate.node >= 0 && candidate.lastUsed >= cloudFrame)) {
+						continue;
+					}
+					if (slot < 0 || candidate.node < 0 ||
+						(cloudSlots[slot].node >= 0 && candidate.lastUsed < cloudSlots[slot].lastUsed)) {
+						slot = (int)s;
+					}
+					if (candidate.node < 0) {
+						break;
+					}
+				}
+			}
+			if (node >= 0 && slot >= 0) {
+				CloudSlot &target = cloudSlots[slot];
+				if (target.node >= 0) {
+					cloudNodeSlot[target.node] = -1;
+				}
+				target.node = -1;
+				target.loading = true;
+				cloudNodeLoading[node] = 1;
+			}
+		}
+
+		if (node < 0 || slot < 0) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(2));
+			continue;
+		}
+
+		readCloudNode(node, cloudSlots[slot]);
+
+		std::lock_guard<std::mutex> lock(cloudMutex);
+		cloudSlots[slot].node = node;
+		cloudSlots[slot].loading = false;
+		// Counts as used this frame, so it is not the next slot evicted before it is drawn
+		cloudSlots[slot].lastUsed = cloudFrame;
+		cloudNodeSlot[node] = slot;
+		cloudNodeLoading[node] = 0;
+	}
+}
+
+// Stops the loader thread, registered with atexit
+void stopCloudLoader() {
+	cloudLoaderRunning = false;
+	if (cloudLoaderThread.joinable()) {
+		cloudLoaderThread.join();
+	}
+}
+
+// Opens an octree file and starts streaming its nodes. Only the header and node table are read
+// here, at most cloudCacheSlots chunks of points are held in memory at once.
+bool openPointCloud(const char * filename) {
+	OctreeHeader header;
+#ifdef _WIN32
+	cloudFile = fopen(filename, "rb");
+	if (cloudFile == NULL || fread(&header, sizeof(header), 1, cloudFile) != 1) {
+		printf("Could not open %s\n", filename);
+		return false;
+	}
+#else
+	int fd = open(filename, O_RDONLY);
+	struct stat info;
+	if (fd < 0 || fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(header)) {
+		printf("Could not open %s\n", filename);
+		if (fd >= 0) close(fd);
+		return false;
+	}
+	cloudMappingBytes = (size_t)info.st_size;
+	void * mapping = mmap(NULL, cloudMappingBytes, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		printf("Could not map %s\n", filename);
+		return false;
+	}
+	cloudMapping = (const unsigned char *)mapping;
+	memcpy(&header, cloudMapping, sizeof(header));
+#endif
+	if (memcmp(header.magic, "OCTREE1", 8) != 0 || header.nodeCount == 0) {
+		printf("%s is not an octree file\n", filename);
+		return false;
+	}
+
+	cloudHeader = header;
+	cloudNodes.resize(header.nodeCount);
+#ifdef _WIN32
+	fileSeek(cloudFile, header.nodeTableOffset);
+	fread(cloudNodes.data(), sizeof(OctreeNode), cloudNodes.size(), cloudFile);
+#else
+	memcpy(cloudNodes.data(), cloudMapping + header.nodeTableOffset, sizeof(OctreeNode) * cloudNodes.size());
+#endif
+
+	cloudNodeSlot.assign(cloudNodes.size(), -1);
+	cloudNodeLoading.assign(cloudNodes.size(), 0);
+	cloudSlots.resize(cloudCacheSlots);
+	for (size_t s = 0; s < cloudSlots.size(); s++) {
+		cloudSlots[s].node = -1;
+		cloudSlots[s].loading = false;
+		cloudSlots[s].lastUsed = 0;
+		cloudSlots[s].count = 0;
+	}
+
+	cloudLoaderRunning = true;
+	cloudLoaderThread = std::thread(cloudLoaderLoop);
+	atexit(stopCloudLoader);
+	printf("%s: %llu points in %u nodes\n", filename, (unsigned long long)header.pointCount, header.nodeCount);
+	return true;
+}
+
+// Multiplies two column-major 4x4 matrices, out = a * b
+void multiplyMatrices(const GLfloat a[16], const GLfloat b[16], GLfloat out[16]) {
+	for (int col = 0; col < 4; col++) {
+		for (int row = 0; row < 4; row++) {
+			float sum = 0.0f;
+			for (int k = 0; k < 4; k++) {
+				sum += a[k * 4 + row] * b[col * 4 + k];
+			}
+			out[col * 4 + row] = sum;
+		}
+	}
+}
+
+// Returns true if the box lies entirely outside one of the frustum planes of the clip matrix
+bool boxOutsideFrustum(const GLfloat clip[16], const float min[3], const float max[3]) {
+	for (int p = 0; p < 6; p++) {
+		// Planes are the 4th row plus or minus one of the other rows
+		int axis = p / 2;
+		float sign = (p % 2 == 0) ? 1.0f : -1.0f;
+		float plane[4];
+		for (int k = 0; k < 4; k++) {
+			plane[k] = clip[k * 4 + 3] + sign * clip[k * 4 + axis];
+		}
+		// Tests the corner furthest along the plane normal
+		float distance = plane[3];
+		for (int k = 0; k < 3; k++) {
+			distance += plane[k] * (plane[k] >= 0.0f ? max[k] : min[k]);
+		}
+		if (distance < 0.0f) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Returns the screen space error of a node, roughly the on screen gap in pixels between the
+// points of its sample
+float nodeScreenError(const OctreeNode &node, const GLfloat modelview[16], float pixelScale) {
+	float centre[3], radius = 0.0f;
+	for (int k = 0; k < 3; k++) {
+		centre[k] = (node.min[k] + node.max[k]) * 0.5f;
+		radius += (node.max[k] - node.min[k]) * (node.max[k] - node.min[k]) * 0.25f;
+	}
+	radius = sqrt(radius);
+
+	float eye[3];
+	for (int row = 0; row < 3; row++) {
+		eye[row] = modelview[row] * centre[0] + modelview[4 + row] * centre[1] + modelview[8 + row] * centre[2] + modelview[12 + row];
+	}
+	float distance = std::max(0.1f, vectorLength({ eye[0], eye[1], eye[2] }) - radius);
+	float projected = 2.0f * radius / distance * pixelScale;
+	return projected / sqrt((float)cloudHeader.chunkPoints);
+}
+
+// Draws the resident nodes whose error is above maxCloudError, most important first, until the
+// points per frame budget is reached. Missing nodes are requested from the loader and drawn in
+// a later frame, their ancestors stand in for them until then.
+void drawPointCloud() {
+	if (cloudNodes.empty()) {
+		return;
+	}
+
+	GLfloat modelview[16], projection[16], clip[16];
+	glGetFloatv(GL_MODELVIEW_MATRIX, modelview);
+	glGetFloatv(GL_PROJECTION_MATRIX, projection);
+	multiplyMatrices(projection, modelview, clip);
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	float pixelScale = viewport[3] / (2.0f * tan(22.5f * M_PI / 180.0f));
+
+	std::priority_queue<std::pair<float, int>> queue;
+	std::vector<int> draw;
+	std::vector<int> requests;
+	size_t points = 0;
+	{
+		std::lock_guard<std::mutex> lock(cloudMutex);
+		cloudFrame++;
+		queue.push(std::make_pair(nodeScreenError(cloudNodes[0], modelview, pixelScale), 0));
+		while (!queue.empty()) {
+			int n = queue.top().second;
+			queue.pop();
+			const OctreeNode &node = cloudNodes[n];
+			if (boxOutsideFrustum(clip, node.min, node.max)) {
+				continue;
+			}
+			if (cloudNodeSlot[n] < 0) {
+				if (requests.size() < 64) {
+					requests.push_back(n);
+				}
+				continue;
+			}
+			if (points + node.pointCount > cloudPointBudget) {
+				break;
+			}
+
+			CloudSlot &slot = cloudSlots[cloudNodeSlot[n]];
+			slot.lastUsed = cloudFrame;
+			draw.push_back(cloudNodeSlot[n]);
+			points += slot.count;
+
+			for (int c = 0; c < 8; c++) {
+				if (node.children[c] < 0) {
+					continue;
+				}
+				float error = nodeScreenError(cloudNodes[node.children[c]], modelview, pixelScale);
+				if (error > maxCloudError) {
+					queue.push(std::make_pair(error, (int)node.children[c]));
+				}
+			}
+		}
+		cloudRequests.swap(requests);
+	}
+
+	// Slots drawn this frame are not evicted until the next frame, so they are safe to read here
+	glColor3f(1.0f, 1.0f, 1.0f);
+	glPointSize(1);
+	glEnableClientState(GL_VERTEX_ARRAY);
+	for (size_t i = 0; i < draw.size(); i++) {
+		glVertexPointer(3, GL_FLOAT, 0, cloudSlots[draw[i]].points.data());
+		glDrawArrays(GL_POINTS, 0, cloudSlots[draw[i]].count);
+	}
+	glDisableClientState(GL_VERTEX_ARRAY);
+	cloudPointsDrawn = points;
+}
+
+/*********************************************************************************************
+	LOAD OBJECTS
+*********************************************************************************************/
+// An object kept in memory after switching away from it. Its arrays are moved in and out
+// of the store, so switching back needs no parsing and no copying.
+struct ResidentMesh {
+	std::vector<std::array<float, 3>> vertices;
+	std::vector<std::array<int, 3>> triVertexIndices;
+	std::vector<std::array<int, 4>> quadVertexIndices;
+	std::vector<MeshChunk> chunks;
+	GLuint texture;
+	std::vector<unsigned char> texturePixels;
+	CompressedTexture textureBlocks;
+};
+
+std::map<std::string, ResidentMesh> residentMeshes;
+std::string currentMeshName;     // Object held in the global arrays, empty if none
+std::string currentTextureName;  // Its texture, empty if it has none
+
+// Moves the current object into the resident store, leaving the global arrays empty
+void stashCurrentMesh() {
+	if (!currentMeshName.empty()) {
+		ResidentMesh &mesh = residentMeshes[currentMeshName];
+		mesh.vertices = std::move(vertices);
+		mesh.triVertexIndices = std::move(triVertexIndices);
+		mesh.quadVertexIndices = std::move(quadVertexIndices);
+		mesh.chunks = std::move(meshChunks);
+		mesh.texture = currentTextureName.empty() ? 0 : texture;
+		mesh.texturePixels = std::move(texturePixels);
+		mesh.textureBlocks = std::move(textureBlocks);
+	}
+	vertices.clear();
+	triVertexIndices.clear();
+	quadVertexIndices.clear();
+	meshChunks.clear();
+	texturePixels.clear();
+	textureBlocks.levels.clear();
+	currentMeshName.clear();
+	meshGeneration++;
+	currentTextureName.clear();
+}
+
+// Moves the current object into the resident store and an object back out of it. Returns false,
+// leaving the current object in place, if it has to be loaded because it was never loaded or one
+// of its files changed while it was stored.
+bool restoreMesh(const char * obj, const char * bmp) {
+	std::map<std::string, ResidentMesh>::iterator stored = residentMeshes.find(obj);
+	if (stored == residentMeshes.end()) {
+		return false;
+	}
+
+	bool stale = false;
+	{
+		std::lock_guard<std::mutex> lock(reloadMutex);
+		for (size_t i = 0; i < staleAssets.size(); ) {
+			if (staleAssets[i] == obj || (bmp != NULL && staleAssets[i] == bmp)) {
+				stale = true;
+				staleAssets.erase(staleAssets.begin() + i);
+			}
+			else {
+				i++;
+			}
+		}
+	}
+	if (stale) {
+		if (stored->second.texture != 0) {
+			glDeleteTextures(1, &stored->second.texture);
+		}
+		releaseMeshChunks(stored->second.chunks);
+		residentMeshes.erase(stored);
+		return false;
+	}
+
+	stashCurrentMesh();
+	ResidentMesh &mesh = stored->second;
+	vertices = std::move(mesh.vertices);
+	triVertexIndices = std::move(mesh.triVertexIndices);
+	quadVertexIndices = std::move(mesh.quadVertexIndices);
+	meshChunks = std::move(mesh.chunks);
+	texturePixels = std::move(mesh.texturePixels);
+	textureBlocks = std::move(mesh.textureBlocks);
+	if (bmp != NULL) {
+		texture = mesh.texture;
+		glBindTexture(GL_TEXTURE_2D, texture);
+	}
+	residentMeshes.erase(stored);
+
+	currentMeshName = obj;
+	currentTextureName = bmp != NULL ? bmp : "";
+	printf("%s: restored from the resident store\n", obj);
+	return true;
+}
+
+// Records a freshly loaded object as the current one and prints what the load cost
+void finishLoad(bool loaded, const char * obj, const char * bmp, const LoadStats &stats) {
+	if (loaded) {
+		currentMeshName = obj;
+		currentTextureName = bmp != NULL ? bmp : "";
+	}
+	printLoadStats(obj, stats, meshBytes(vertices, triVertexIndices) + quadVertexIndices.capacity() * sizeof(std::array<int, 4>));
+}
+
+// An object parsed by the loader thread, waiting for the render thread to upload its texture
+struct ObjectLoad {
+	char object;        // Key of the object, '1' to '4'
+	const char * obj;
+	const char * bmp;   // NULL if the object is not textured
+	bool quads;
+	bool * loadFlag;    // loadCube, loadBunny, loadSD or loadElephant
+	bool loaded;
+	bool textured;      // The texture was read
+	std::vector<std::array<float, 3>> vertices;
+	std::vector<std::array<int, 3>> triVertexIndices;
+	std::vector<std::array<int, 4>> quadVertexIndices;
+	std::vector<MeshChunk> chunks;
+	PreparedTexture texture;
+	LoadStats stats;
+};
+
+// Objects are handed to the loader thread and back under loadMutex
+std::mutex loadMutex;
+std::condition_variable loadReady;     // A request was queued or the loader is stopping
+std::condition_variable loadFinished;  // The loader finished an object
+std::deque<ObjectLoad> loadRequests;
+std::vector<ObjectLoad> finishedLoads;
+bool loaderStopping = false;
+std::thread loaderThread;
+
+// Render thread only
+std::vector<std::string> loadingObjects;  // Objects queued or being parsed
+char requestedObject = 0;                 // The object most recently selected
+
+// Loader thread - parses an object, cleans it, splits it into chunks and prepares its texture
+void parseObject(ObjectLoad &load) {
+	load.stats = beginLoadStats();
+	if (load.quads) {
+		// Sizes the arrays from a scan of the file so the loader never regrows them
+		reserveForObj(load.obj, load.vertices, load.quadVertexIndices);
+		// Uses the cubeobjloader header to load the vertex data
+		load.loaded = load_cube_obj(load.obj, load.vertices, load.quadVertexIndices);
+		if (load.loaded) {
+			// Welds duplicate vertices and removes degenerate and duplicate faces
+			printCleanupStats(load.obj, cleanMesh(load.vertices, load.quadVertexIndices));
+			// Splits the faces into chunks for occlusion culling
+			load.chunks = buildMeshChunks(load.vertices, load.quadVertexIndices);
+		}
+	}
+	else {
+		reserveForObj(load.obj, load.vertices, load.triVertexIndices);
+		// Uses the objloader header to load the vertex data
+		load.loaded = load_obj(load.obj, load.vertices, load.triVertexIndices);
+		if (load.loaded) {
+			printCleanupStats(load.obj, cleanMesh(load.vertices, load.triVertexIndices));
+			load.chunks = buildMeshChunks(load.vertices, load.triVertexIndices);
+		}
+	}
+	// Reads the texture and encodes it if it is not in the texture cache
+	load.textured = load.bmp != NULL && prepareTexture(load.bmp, load.texture);
+	endLoadStats(load.stats);
+}
+
+void loaderLoop() {
+	while (true) {
+		ObjectLoad load = {};
+		{
+			std::unique_lock<std::mutex> lock(loadMutex);
+			loadReady.wait(lock, []() { return loaderStopping || !loadRequests.empty(); });
+			if (loaderStopping) {
+				return;
+			}
+			load = std::move(loadRequests.front());
+			loadRequests.pop_front();
+		}
+
+		parseObject(load);
+
+		{
+			std::lock_guard<std::mutex> lock(loadMutex);
+			finishedLoads.push_back(std::move(load));
+		}
+		loadFinished.notify_one();
+	}
+}
+
+// Stops the loader thread, registered with atexit. An object still being parsed is finished
+// first, queued ones are dropped.
+void stopObjectLoader() {
+	{
+		std::lock_guard<std::mutex> lock(loadMutex);
+		loaderStopping = true;
+	}
+	loadReady.notify_all();
+	loaderThread.join();
+}
+
+// Hands an object to the loader thread, starting it the first time
+void queueObjectLoad(char object, const char * obj, const char * bmp, bool quads, bool &loadFlag) {
+	if (!loaderThread.joinable()) {
+		loaderThread = std::thread(loaderLoop);
+		atexit(stopObjectLoader);
+	}
+	ObjectLoad load = {};
+	load.object = object;
+	load.obj = obj;
+	load.bmp = bmp;
+	load.quads = quads;
+	load.loadFlag = &loadFlag;
+	{
+		std::lock_guard<std::mutex> lock(loadMutex);
+		loadRequests.push_back(std::move(load));
+	}
+	loadReady.notify_one();
+	loadingObjects.push_back(obj);
+	printf("%s: loading\n", obj);
+}
+
+// Render thread - uploads the texture of a parsed object. The object becomes the current one if
+// it is still the one selected, otherwise it goes straight into the resident store.
+void applyObjectLoad(ObjectLoad &load) {
+	loadingObjects.erase(std::find(loadingObjects.begin(), loadingObjects.end(), load.obj));
+	*load.loadFlag = load.loaded;
+
+	if (load.object == requestedObject) {
+		// Moves the current object into the resident store, leaving the global arrays empty
+		stashCurrentMesh();
+		renderobj = load.object;
+		vertices = std::move(load.vertices);
+		triVertexIndices = std::move(load.triVertexIndices);
+		quadVertexIndices = std::move(load.quadVertexIndices);
+		meshChunks = std::move(load.chunks);
+		if (load.bmp != NULL) {
+			texture = load.textured ? LoadTexture(load.bmp, load.texture) : 0;
+			texturePixels = std::move(load.texture.pixels);
+			textureBlocks = std::move(load.texture.blocks);
+		}
+		finishLoad(load.loaded, load.obj, load.bmp, load.stats);
+		// Watches the object's files for changes
+		setWatchedAssets(load.obj, load.bmp, load.quads);
+		return;
+	}
+
+	if (!load.loaded) {
+		return;
+	}
+	ResidentMesh &mesh = residentMeshes[load.obj];
+	mesh.vertices = std::move(load.vertices);
+	mesh.triVertexIndices = std::move(load.triVertexIndices);
+	mesh.quadVertexIndices = std::move(load.quadVertexIndices);
+	mesh.chunks = std::move(load.chunks);
+	mesh.texture = 0;
+	if (load.textured) {
+		mesh.texture = LoadTexture(load.bmp, load.texture);
+		mesh.texturePixels = std::move(load.texture.pixels);
+		mesh.textureBlocks = std::move(load.texture.blocks);
+		glBindTexture(GL_TEXTURE_2D, texture);
+	}
+	printf("%s: loaded after switching away, kept in the resident store\n", load.obj);
+}
+
+// Render thread - applies the objects the loader thread has finished. Never waits on the loader,
+// except during a replay, where every queued object is waited for so it appears on the same
+// frame in every run.
+void applyFinishedLoads() {
+	std::vector<ObjectLoad> loads;
+	{
+		std::unique_lock<std::mutex> lock(loadMutex, std::defer_lock);
+		if (replaying) {
+			lock.lock();
+			loadFinished.wait(lock, []() { return finishedLoads.size() == loadingObjects.size(); });
+		}
+		else if (!lock.try_lock()) {
+			return;
+		}
+		loads.swap(finishedLoads);
+	}
+
+	for (size_t i = 0; i < loads.size(); i++) {
+		applyObjectLoad(loads[i]);
+	}
+}
+
+// Switches to an object. A stored object is swapped back in at once, any other is parsed on the
+// loader thread while the current object keeps being drawn.
+void selectObject(char object, const char * obj, const char * bmp, bool quads, bool &loadFlag) {
+	requestedObject = object;
+	// Already in the global arrays, e.g. when switching back from the point cloud
+	if (currentMeshName == obj) {
+		renderobj = object;
+	}
+	// Takes the object back out of the store if it was loaded before
+	else if (restoreMesh(obj, bmp)) {
+		renderobj = object;
+	}
+	else {
+		if (std::find(loadingObjects.begin(), loadingObjects.end(), obj) == loadingObjects.end()) {
+			queueObjectLoad(object, obj, bmp, quads, loadFlag);
+		}
+		return;
+	}
+	// Watches the object's files for changes
+	setWatchedAssets(obj, bmp, quads);
+}
+
+// Load Cube Object
+void cube() {
+	selectObject('1', "cube3.obj", "dice.bmp", true, loadCube);
+}
+
+// Load Bunny Object
+void bunny() {
+	selectObject('2', "bunny.obj", NULL, false, loadBunny);
+}
+
+// Load Screwdriver Object
+void screwdriver() {
+	selectObject('3', "screwdriver.obj", NULL, false, loadSD);
+}
+
+// Load Elephant Object
+void elephant() {
+	selectObject('4', "elephant3.obj", "yarn2.bmp", true, loadElephant);
+}
+
+// Load Point Cloud Object
+void pointCloud() {
+	if (pointCloudFile == NULL) {
+		printf("No point cloud, start with --pointcloud <file.oct>\n");
+		return;
+	}
+	// Opens and starts streaming the octree the first time it is selected
+	if (cloudNodes.empty() && !openPointCloud(pointCloudFile)) {
+		return;
+	}
+	renderobj  = '5';
+	requestedObject = '5';
+	// Point clouds are not watched for changes
+	setWatchedAssets("", NULL, false);
+}
+
+/*********************************************************************************************
+	FRAME CAPTURE
+*********************************************************************************************/
+
+// A read back frame waiting to be encoded and written to disk
+struct CaptureJob {
+	std::vector<unsigned char> pixels;  // RGBA rows, bottom row first
+	int width;
+	int height;
+	int frame;
+	char format;  // 'p' for PNG, 'r' for raw PPM
+};
+
+// Ring of pixel buffers. Frame n is read into buffer n % 3 and mapped 3 frames later, by
+// which point the GPU has finished the copy and mapping does not stall.
+const int captureBufferCount = 3;
+GLuint capturePBOs[captureBufferCount];
+int capturePBOBytes[captureBufferCount] = { 0, 0, 0 };
+int capturePending[captureBufferCount] = { -1, -1, -1 };  // Frame number held by each buffer
+int capturePendingWidth[captureBufferCount];
+int capturePendingHeight[captureBufferCount];
+char capturePendingFormat[captureBufferCount];  // Format chosen when the frame was read
+int captureSlot = 0;
+bool capturePBOsCreated = false;
+
+// Encoder pool. Queueing blocks once this many frames are waiting, so a slow disk slows
+// the capture down instead of using up all the memory.
+const size_t captureQueueLimit = 32;
+std::deque<CaptureJob> captureJobs;
+std::mutex captureMutex;
+std::condition_variable captureReady;
+std::condition_variable captureSpace;
+std::vector<std::thread> captureWorkers;
+bool captureStopping = false;
+
+// Table for the PNG chunk CRC
+unsigned int crcTable[256];
+
+void buildCrcTable() {
+	for (unsigned int n = 0; n < 256; n++) {
+		unsigned int c = n;
+		for (int k = 0; k < 8; k++) {
+			c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+		}
+		crcTable[n] = c;
+	}
+}
+
+// Appends a 32 bit big endian value
+void putBE32(std::vector<unsigned char> &out, unsigned int value) {
+	out.push_back((value >> 24) & 0xFF);
+	out.push_back((value >> 16) & 0xFF);
+	out.push_back((value >> 8) & 0xFF);
+	out.push_back(value & 0xFF);
+}
+
+// Appends a PNG chunk with its length and CRC
+void putPNGChunk(std::vector<unsigned char> &out, const char * type, const std::vector<unsigned char> &data) {
+	putBE32(out, (unsigned int)data.size());
+	size_t start = out.size();
+	out.insert(out.end(), type, type + 4);
+	out.insert(out.end(), data.begin(), data.end());
+
+	unsigned int crc = 0xFFFFFFFFu;
+	for (size_t i = start; i < out.size(); i++) {
+		crc = crcTable[(crc ^ out[i]) & 0xFF] ^ (crc >> 8);
+	}
+	putBE32(out, crc ^ 0xFFFFFFFFu);
+}
+
+// Encodes RGBA pixels (bottom row first, as read from OpenGL) as an RGB PNG. The image data
+// uses stored deflate blocks, which is larger on disk but costs no more than a copy to encode.
+std::vector<unsigned char> encodePNG(const CaptureJob &job) {
+	// Filter type 0 followed by the RGB values of each row, flipped to top row first
+	std::vector<unsigned char> raw;
+	raw.reserve((size_t)job.height * (job.width * 3 + 1));
+	for (int y = job.height - 1; y >= 0; y--) {
+		raw.push_back(0);
+		const unsigned char * row = &job.pixels[(size_t)y * job.width * 4];
+		for (int x = 0; x < job.width; x++) {
+			raw.push_back(row[x * 4]);
+			raw.push_back(row[x * 4 + 1]);
+			raw.push_back(row[x * 4 + 2]);
+		}
+	}
+
+	// zlib stream of stored blocks, at most 65535 bytes each
+	std::vector<unsigned char> zlib;
+	zlib.reserve(raw.size() + raw.size() / 65535 * 5 + 16);
+	zlib.push_back(0x78);
+	zlib.push_back(0x01);
+	size_t offset = 0;
+	do {
+		size_t length = std::min(raw.size() - offset, (size_t)65535);
+		zlib.push_back(offset + length == raw.size() ? 1 : 0);
+		zlib.push_back(length & 0xFF);
+		zlib.push_back((length >> 8) & 0xFF);
+		zlib.push_back(~length & 0xFF);
+		zlib.push_back((~length >> 8) & 0xFF);
+		zlib.insert(zlib.end(), raw.begin() + offset, raw.begin() + offset + length);
+		offset += length;
+	} while (offset < raw.size());
+
+	unsigned int a = 1, b = 0;
+	for (size_t i = 0; i < raw.size(); i++) {
+		a = (a + raw[i]) % 65521;
+		b = (b + a) % 65521;
+	}
+	putBE32(zlib, (b << 16) | a);
+
+	std::vector<unsigned char> header;
+	putBE32(header, job.width);
+	putBE32(header, job.height);
+	header.push_back(8);  // Bit depth
+	header.push_back(2);  // RGB colour
+	header.push_back(0);  // Compression, filter and interlace methods
+	header.push_back(0);
+	header.push_back(0);
+
+	std::vector<unsigned char> png = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	putPNGChunk(png, "IHDR", header);
+	putPNGChunk(png, "IDAT", zlib);
+	putPNGChunk(png, "IEND", std::vector<unsigned char>());
+	return png;
+}
+
+// Encodes RGBA pixels as a binary PPM, the raw RGB values behind a one line header
+std::vector<unsigned char> encodePPM(const CaptureJob &job) {
+	char header[64];
+	int headerLength = snprintf(header, sizeof(header), "P6\n%d %d\n255\n", job.width, job.height);
+	std::vector<unsigned char> ppm(header, header + headerLength);
+	ppm.reserve(headerLength + (size_t)job.width * job.height * 3);
+	for (int y = job.height - 1; y >= 0; y--) {
+		const unsigned char * row = &job.pixels[(size_t)y * job.width * 4];
+		for (int x = 0; x < job.width; x++) {
+			ppm.push_back(row[x * 4]);
+			ppm.push_back(row[x * 4 + 1]);
+			ppm.push_back(row[x * 4 + 2]);
+		}
+	}
+	return ppm;
+}
+
+// Encoder thread, writes queued frames to capture_NNNNN.png/.ppm until the pool is stopped
+// and the queue is empty
+void captureWorker() {
+	while (true) {
+		CaptureJob job;
+		{
+			std::unique_lock<std::mutex> lock(captureMutex);
+			captureReady.wait(lock, []() { return captureStopping || !captureJobs.empty(); });
+			if (captureJobs.empty()) {
+				return;
+			}
+			job = std::move(captureJobs.front());
+			captureJobs.pop_front();
+		}
+		captureSpace.notify_one();
+
+		std::vector<unsigned char> data = job.format == 'p' ? encodePNG(job) : encodePPM(job);
+		char filename[64];
+		snprintf(filename, sizeof(filename), "capture_%05d.%s", job.frame, job.format == 'p' ? "png" : "ppm");
+		FILE * file = fopen(filename, "wb");
+		if (file == NULL) {
+			printf("Could not write %s\n", filename);
+			continue;
+		}
+		fwrite(data.data(), 1, data.size(), file);
+		fclose(file);
+	}
+}
+
+// Writes out the remaining frames and stops the encoder threads, registered with atexit
+void stopCaptureWorkers() {
+	{
+		std::lock_guard<std::mutex> lock(captureMutex);
+		captureStopping = true;
+	}
+	captureReady.notify_all();
+	for (size_t i = 0; i < captureWorkers.size(); i++) {
+		captureWorkers[i].join();
+	}
+	captureWorkers.clear();
+}
+
+// Starts the encoder threads the first time capture is turned on
+void startCaptureWorkers() {
+	if (!captureWorkers.empty()) {
+		return;
+	}
+	buildCrcTable();
+	unsigned int threads = std::max(2u, std::thread::hardware_concurrency() / 2);
+	for (unsigned int i = 0; i < threads; i++) {
+		captureWorkers.push_back(std::thread(captureWorker));
+	}
+	atexit(stopCaptureWorkers);
+}
+
+// Hands a frame to the encoder threads, waiting if they are too far behind
+void queueCaptureJob(CaptureJob &job) {
+	{
+		std::unique_lock<std::mutex> lock(captureMutex);
+		captureSpace.wait(lock, []() { return captureJobs.size() < captureQueueLimit; });
+		captureJobs.push_back(std::move(job));
+	}
+	captureReady.notify_one();
+}
+
+// Maps the pixel buffer of a slot, bound by the caller, and hands the frame read into it to the
+// encoder threads
+void collectCapture(int slot) {
+	if (capturePending[slot] < 0) {
+		return;
+	}
+	CaptureJob job;
+	job.width = capturePendingWidth[slot];
+	job.height = capturePendingHeight[slot];
+	job.frame = capturePending[slot];
+	job.format = capturePendingFormat[slot];
+	const unsigned char * mapped = (const unsigned char *)pglMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+	if (mapped != NULL) {
+		job.pixels.assign(mapped, mapped + (size_t)job.width * job.height * 4);
+		pglUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		queueCaptureJob(job);
+	}
+	capturePending[slot] = -1;
+}
+
+// Collects every frame still in the pixel buffers, oldest first. Called before exiting, while
+// the GL context is still current, so the last frames of a capture are not lost.
+void flushCaptureReadbacks() {
+	if (!capturePBOsCreated) {
+		return;
+	}
+	for (int i = 0; i < captureBufferCount; i++) {
+		int slot = (captureSlot + i) % captureBufferCount;
+		pglBindBuffer(GL_PIXEL_PACK_BUFFER, capturePBOs[slot]);
+		collectCapture(slot);
+	}
+	pglBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+// Called at the end of display() before the buffers are swapped. Starts an asynchronous read
+// of the frame just drawn and collects the read started captureBufferCount frames ago.
+void captureReadback() {
+	bool pending = false;
+	for (int i = 0; i < captureBufferCount; i++) {
+		pending = pending || capturePending[i] >= 0;
+	}
+	if (!capturing && !pending) {
+		return;
+	}
+
+	int width = windowWidth;
+	int height = windowHeight;
+	int bytes = width * height * 4;
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glReadBuffer(GL_BACK);
+
+	// Without pixel buffers the frame is read straight away, stalling until the GPU is done
+	if (!hasPixelBuffers) {
+		CaptureJob job;
+		job.pixels.resize(bytes);
+		job.width = width;
+		job.height = height;
+		job.frame = captureFrame++;
+		job.format = captureFormat;
+		glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, job.pixels.data());
+		queueCaptureJob(job);
+		return;
+	}
+
+	if (!capturePBOsCreated) {
+		pglGenBuffers(captureBufferCount, capturePBOs);
+		capturePBOsCreated = true;
+	}
+
+	int slot = captureSlot;
+	captureSlot = (captureSlot + 1) % captureBufferCount;
+	pglBindBuffer(GL_PIXEL_PACK_BUFFER, capturePBOs[slot]);
+
+	// Collects the frame this buffer was given captureBufferCount frames ago
+	collectCapture(slot);
+
+	// Starts reading this frame into the buffer, glReadPixels returns without waiting
+	if (capturing) {
+		if (capturePBOBytes[slot] != bytes) {
+			pglBufferData(GL_PIXEL_PACK_BUFFER, bytes, NULL, GL_STREAM_READ);
+			capturePBOBytes[slot] = bytes;
+		}
+		glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+		capturePending[slot] = captureFrame++;
+		capturePendingWidth[slot] = width;
+		capturePendingHeight[slot] = height;
+		capturePendingFormat[slot] = captureFormat;
+	}
+	pglBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+// Returns the camera position for the turntable orbit. The camera is rotated about the
+// vertical axis through the look point by one step per frame.
+std::array<float, 3> orbitCamera(const FrameState &frame) {
+	float angle = (2.0f * M_PI / orbitFrames) * orbitStep;
+	float x = frame.cam[0] - frame.look[0];
+	float z = frame.cam[2] - frame.look[2];
+	std::array<float, 3> position;
+	position[0] = frame.look[0] + x * cos(angle) + z * sin(angle);
+	position[1] = frame.cam[1];
+	position[2] = frame.look[2] - x * sin(angle) + z * cos(angle);
+	return position;
+}
+
+/*********************************************************************************************
+	DYNAMIC RESOLUTION
+*********************************************************************************************/
+
+// Offscreen target the scene is drawn into at the reduced resolution. The colour is a texture
+// so it can be drawn into a multisampled window, which glBlitFramebuffer can't write to.
+GLuint scaledFramebuffer = 0;
+GLuint scaledColour = 0;
+GLuint scaledDepth = 0;
+int scaledWidth = 0;
+int scaledHeight = 0;
+
+// Controller state
+float resolutionScale = 1.0f;   // Fraction of the window width and height drawn
+float smoothedFrameMs = 0.0f;   // Moving average of the frame time
+std::chrono::steady_clock::time_point lastFrameTime;
+std::chrono::steady_clock::time_point lastInputTime;
+unsigned int lastInputsApplied = 0;
+int shownScalePercent = 100;
+
+// (Re)creates the offscreen colour and depth buffers at the given size
+bool resizeScaledTarget(int width, int height) {
+	if (scaledFramebuffer == 0) {
+		pglGenFramebuffers(1, &scaledFramebuffer);
+		glGenTextures(1, &scaledColour);
+		pglGenRenderbuffers(1, &scaledDepth);
+	}
+	if (width == scaledWidth && height == scaledHeight) {
+		return true;
+	}
+
+	glBindTexture(GL_TEXTURE_2D, scaledColour);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	pglBindRenderbuffer(GL_RENDERBUFFER, scaledDepth);
+	pglRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+	pglBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+	pglBindFramebuffer(GL_FRAMEBUFFER, scaledFramebuffer);
+	pglFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, scaledColour, 0);
+	pglFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, scaledDepth);
+	bool complete = pglCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+	pglBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	scaledWidth = width;
+	scaledHeight = height;
+	return complete;
+}
+
+// Feeds the last frame time into the controller and updates resolutionScale. The scale only
+// moves when the frame time leaves a band around the budget, so it settles instead of
+// resizing the target every frame.
+void updateResolutionScale(const FrameState &frame) {
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	float frameMs = std::chrono::duration<float, std::milli>(now - lastFrameTime).count();
+	lastFrameTime = now;
+
+	// Ignores long gaps, e.g. while the window was hidden or an object was loading
+	if (frameMs > 1000.0f) {
+		return;
+	}
+	smoothedFrameMs = smoothedFrameMs == 0.0f ? frameMs : smoothedFrameMs * 0.9f + frameMs * 0.1f;
+
+	// Full resolution once the camera and object have not moved for a moment
+	if (frame.inputsApplied != lastInputsApplied || orbiting) {
+		lastInputsApplied = frame.inputsApplied;
+		lastInputTime = now;
+	}
+	if (now - lastInputTime > std::chrono::milliseconds(300)) {
+		resolutionScale = 1.0f;
+		return;
+	}
+
+	// Pixel count, and so the fill cost, goes with the square of the scale
+	if (smoothedFrameMs > frameBudgetMs * 1.05f || smoothedFrameMs < frameBudgetMs * 0.85f) {
+		float target = resolutionScale * sqrt(frameBudgetMs / smoothedFrameMs);
+		resolutionScale += (target - resolutionScale) * 0.25f;
+		resolutionScale = std::max(minResolutionScale, std::min(1.0f, resolutionScale));
+	}
+}
+
+// Called at the start of display(). Binds the offscreen target when drawing below full
+// resolution and returns true if it did.
+bool beginScaledFrame(const FrameState &frame) {
+	if (!adaptiveResolution || !hasFramebuffers) {
+		if (shownScalePercent != 100) {
+			glutSetWindowTitle("CM20219 OpenGL Coursework");
+			shownScalePercent = 100;
+		}
+		return false;
+	}
+	updateResolutionScale(frame);
+
+	int percent = (int)(resolutionScale * 100.0f + 0.5f);
+	if (percent != shownScalePercent) {
+		char title[64];
+		snprintf(title, sizeof(title), "CM20219 OpenGL Coursework (%d%% resolution)", percent);
+		glutSetWindowTitle(title);
+		shownScalePercent = percent;
+	}
+	if (resolutionScale >= 1.0f) {
+		return false;
+	}
+
+	// Rounds the size to 8 pixels so small changes in scale reuse the same buffers
+	int width = std::max(8, ((int)(windowWidth * resolutionScale) + 7) / 8 * 8);
+	int height = std::max(8, ((int)(windowHeight * resolutionScale) + 7) / 8 * 8);
+	if (!resizeScaledTarget(width, height)) {
+		return false;
+	}
+	pglBindFramebuffer(GL_FRAMEBUFFER, scaledFramebuffer);
+	glViewport(0, 0, width, height);
+	return true;
+}
+
+// Called once the scene is drawn. Scales the offscreen image up into the window by drawing
+// it as a textured quad over the whole window.
+void endScaledFrame(bool scaled) {
+	if (!scaled) {
+		return;
+	}
+	pglBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glViewport(0, 0, windowWidth, windowHeight);
+
+	glMatrixMode(GL_PROJECTION);
+	glPushMatrix();
+	glLoadIdentity();
+	glMatrixMode(GL_MODELVIEW);
+	glPushMatrix();
+	glLoadIdentity();
+	glDisable(GL_DEPTH_TEST);
+	glEnable(GL_TEXTURE_2D);
+	glBindTexture(GL_TEXTURE_2D, scaledColour);
+	glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+	glBegin(GL_QUADS);
+	glTexCoord2f(0.0f, 0.0f); glVertex2f(-1.0f, -1.0f);
+	glTexCoord2f(1.0f, 0.0f); glVertex2f(1.0f, -1.0f);
+	glTexCoord2f(1.0f, 1.0f); glVertex2f(1.0f, 1.0f);
+	glTexCoord2f(0.0f, 1.0f); glVertex2f(-1.0f, 1.0f);
+	glEnd();
+	glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glDisable(GL_TEXTURE_2D);
+	glEnable(GL_DEPTH_TEST);
+	glPopMatrix();
+	glMatrixMode(GL_PROJECTION);
+	glPopMatrix();
+	glMatrixMode(GL_MODELVIEW);
+}
+
+/*********************************************************************************************
+	SHADOWS
+*********************************************************************************************/
+
+// Depth map of the current object seen from GL_LIGHT0
+const int shadowMapSize = 2048;
+GLuint shadowFramebuffer = 0;
+GLuint shadowTexture = 0;
+GLfloat shadowMatrix[16];  // World space to shadow map coordinates
+
+// What the shadow map was drawn for. The map is only drawn again when one of these changes,
+// moving the camera alone reuses it.
+struct ShadowKey {
+	GLfloat light[4];
+	GLfloat rotation[16];
+	char object;
+	unsigned int meshGeneration;
+};
+ShadowKey shadowKey;
+bool shadowMapValid = false;
+
+size_t shadowRenders = 0;  // Times the map was drawn since the last report
+size_t shadowReuses = 0;   // Frames that reused the map since the last report
+double shadowRenderMs = 0.0;
+std::chrono::steady_clock::time_point shadowReportTime;
+
+// Creates the depth texture and the framebuffer that draws into it. The texture compares
+// against the R coordinate, with linear filtering the hardware blends the results of the
+// four nearest texels (percentage closer filtering).
+bool createShadowMap() {
+	pglActiveTexture(GL_TEXTURE1);
+	glGenTextures(1, &shadowTexture);
+	glBindTexture(GL_TEXTURE_2D, shadowTexture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, shadowMapSize, shadowMapSize, 0,
+		GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_R_TO_TEXTURE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+	glTexParameteri(GL_TEXTURE_2D, GL_DEPTH_TEXTURE_MODE, GL_LUMINANCE);
+	pglActiveTexture(GL_TEXTURE0);
+
+	pglGenFramebuffers(1, &shadowFramebuffer);
+	pglBindFramebuffer(GL_FRAMEBUFFER, shadowFramebuffer);
+	pglFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, shadowTexture, 0);
+	glDrawBuffer(GL_NONE);
+	glReadBuffer(GL_NONE);
+	bool complete = pglCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+	pglBindFramebuffer(GL_FRAMEBUFFER, 0);
+	return complete;
+}
+
+// Sends every face of the current object as bare positions for the depth pass
+void drawShadowCasters() {
+	if (renderobj == '1' || renderobj == '4') {
+		glBegin(GL_QUADS);
+		for (size_t i = 0; i < quadVertexIndices.size(); i++) {
+			for (int k = 0; k < 4; k++) {
+				glVertex3fv(vertices[quadVertexIndices[i][k] - 1].data());
+			}
+		}
+		glEnd();
+	}
+	else {
+		glBegin(GL_TRIANGLES);
+		for (size_t i = 0; i < triVertexIndices.size(); i++) {
+			for (int k = 0; k < 3; k++) {
+				glVertex3fv(vertices[triVertexIndices[i][k] - 1].data());
+			}
+		}
+		glEnd();
+	}
+}
+
+// Draws the object's depth from the light into the shadow map. The light is directional, so
+// the map is an orthographic view along the light direction fitted around the object's
+// bounding sphere.
+void renderShadowMap(const GLfloat rotation[16]) {
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	// Object to world matrix
+	glMatrixMode(GL_MODELVIEW);
+	glPushMatrix();
+	glLoadIdentity();
+	placeObject(renderobj, rotation);
+	GLfloat world[16];
+	glGetFloatv(GL_MODELVIEW_MATRIX, world);
+
+	// World space bounding sphere from the corners of the object's bounding box
+	float min[3] = { std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max() };
+	float max[3] = { -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max() };
+	for (size_t v = 0; v < vertices.size(); v++) {
+		for (int k = 0; k < 3; k++) {
+			min[k] = std::min(min[k], vertices[v][k]);
+			max[k] = std::max(max[k], vertices[v][k]);
+		}
+	}
+	float corners[8][3];
+	float centre[3] = { 0.0f, 0.0f, 0.0f };
+	for (int corner = 0; corner < 8; corner++) {
+		float p[3] = { (corner & 1) ? max[0] : min[0], (corner & 2) ? max[1] : min[1], (corner & 4) ? max[2] : min[2] };
+		for (int k = 0; k < 3; k++) {
+			corners[corner][k] = world[k] * p[0] + world[4 + k] * p[1] + world[8 + k] * p[2] + world[12 + k];
+			centre[k] += corners[corner][k] / 8.0f;
+		}
+	}
+	float radius = 1e-3f;
+	for (int corner = 0; corner < 8; corner++) {
+		radius = std::max(radius, vectorLength({ corners[corner][0] - centre[0], corners[corner][1] - centre[1], corners[corner][2] - centre[2] }));
+	}
+
+	// Light view, looking at the centre from two radii along the light direction
+	float length = vectorLength({ lightPosition[0], lightPosition[1], lightPosition[2] });
+	float direction[3] = { lightPosition[0] / length, lightPosition[1] / length, lightPosition[2] / length };
+	float up[3] = { 0.0f, 1.0f, 0.0f };
+	if (fabs(direction[1]) > 0.99f) {
+		up[1] = 0.0f;
+		up[2] = 1.0f;
+	}
+	glLoadIdentity();
+	gluLookAt(centre[0] + direction[0] * radius * 2.0f, centre[1] + direction[1] * radius * 2.0f, centre[2] + direction[2] * radius * 2.0f,
+		centre[0], centre[1], centre[2], up[0], up[1], up[2]);
+	GLfloat lightView[16];
+	glGetFloatv(GL_MODELVIEW_MATRIX, lightView);
+
+	glMatrixMode(GL_PROJECTION);
+	glPushMatrix();
+	glLoadIdentity();
+	glOrtho(-radius, radius, -radius, radius, radius * 0.5f, radius * 3.5f);
+	GLfloat lightProjection[16];
+	glGetFloatv(GL_PROJECTION_MATRIX, lightProjection);
+
+	// Depth only, pushed back a little so lit faces do not shadow themselves
+	pglBindFramebuffer(GL_FRAMEBUFFER, shadowFramebuffer);
+	glViewport(0, 0, shadowMapSize, shadowMapSize);
+	glClear(GL_DEPTH_BUFFER_BIT);
+	glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+	glEnable(GL_POLYGON_OFFSET_FILL);
+	glPolygonOffset(2.0f, 4.0f);
+	glMatrixMode(GL_MODELVIEW);
+	glMultMatrixf(world);
+	drawShadowCasters();
+	glDisable(GL_POLYGON_OFFSET_FILL);
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+	pglBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glViewport(0, 0, windowWidth, windowHeight);
+
+	glMatrixMode(GL_PROJECTION);
+	glPopMatrix();
+	glMatrixMode(GL_MODELVIEW);
+	glPopMatrix();
+
+	// Maps clip space [-1, 1] to texture space [0, 1]
+	static const GLfloat bias[16] = {
+		0.5f, 0.0f, 0.0f, 0.0f,
+		0.0f, 0.5f, 0.0f, 0.0f,
+		0.0f, 0.0f, 0.5f, 0.0f,
+		0.5f, 0.5f, 0.5f, 1.0f
+	};
+	GLfloat lightViewProjection[16];
+	multiplyMatrices(lightProjection, lightView, lightViewProjection);
+	multiplyMatrices(bias, lightViewProjection, shadowMatrix);
+
+	shadowRenders++;
+	shadowRenderMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Called at the start of display(), before any offscreen target is bound. Draws the shadow map
+// again if the light, the object or its rotation changed since it was last drawn, and returns
+// true if there is a map to draw shadows with.
+bool updateShadowMap(const GLfloat rotation[16]) {
+	if (!shadows || !hasShadowMaps || renderobj < '1' || renderobj > '4' || vertices.empty()) {
+		return false;
+	}
+	if (shadowFramebuffer == 0 && !createShadowMap()) {
+		printf("Shadow map framebuffer incomplete, shadows off\n");
+		hasShadowMaps = false;
+		return false;
+	}
+
+	ShadowKey key;
+	memset(&key, 0, sizeof(key));  // Clears the padding so keys compare with memcmp
+	memcpy(key.light, lightPosition, sizeof(key.light));
+	memcpy(key.rotation, rotation, sizeof(key.rotation));
+	key.object = renderobj;
+	key.meshGeneration = meshGeneration;
+	if (shadowMapValid && memcmp(&key, &shadowKey, sizeof(key)) == 0) {
+		shadowReuses++;
+	}
+	else {
+		renderShadowMap(rotation);
+		shadowKey = key;
+		shadowMapValid = true;
+	}
+
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	if (now - shadowReportTime > std::chrono::seconds(1)) {
+		if (shadowRenders > 0) {
+			printf("Shadow map: drawn %zu times (last %.1f ms), reused for %zu frames\n", shadowRenders, shadowRenderMs, shadowReuses);
+		}
+		shadowRenders = 0;
+		shadowReuses = 0;
+		shadowReportTime = now;
+	}
+	return true;
+}
+
+// Turns on the shadow lookup on texture unit 1. Must be called with only the camera's view
+// matrix on the modelview stack: eye planes are stored multiplied by its inverse, so the
+// generated coordinates are world positions, which the texture matrix takes into the map.
+// The compared depth modulates the lit colour.
+void beginShadowedDraw() {
+	static const GLfloat planes[4][4] = {
+		{ 1.0f, 0.0f, 0.0f, 0.0f },
+		{ 0.0f, 1.0f, 0.0f, 0.0f },
+		{ 0.0f, 0.0f, 1.0f, 0.0f },
+		{ 0.0f, 0.0f, 0.0f, 1.0f }
+	};
+	static const GLenum coords[4] = { GL_S, GL_T, GL_R, GL_Q };
+	static const GLenum gens[4] = { GL_TEXTURE_GEN_S, GL_TEXTURE_GEN_T, GL_TEXTURE_GEN_R, GL_TEXTURE_GEN_Q };
+
+	pglActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, shadowTexture);
+	glEnable(GL_TEXTURE_2D);
+	glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+	for (int i = 0; i < 4; i++) {
+		glTexGeni(coords[i], GL_TEXTURE_GEN_MODE, GL_EYE_LINEAR);
+		glTexGenfv(coords[i], GL_EYE_PLANE, planes[i]);
+		glEnable(gens[i]);
+	}
+	glMatrixMode(GL_TEXTURE);
+	glLoadMatrixf(shadowMatrix);
+	glMatrixMode(GL_MODELVIEW);
+	pglActiveTexture(GL_TEXTURE0);
+}
+
+// Turns the shadow lookup off again
+void endShadowedDraw() {
+	pglActiveTexture(GL_TEXTURE1);
+	glDisable(GL_TEXTURE_2D);
+	glDisable(GL_TEXTURE_GEN_S);
+	glDisable(GL_TEXTURE_GEN_T);
+	glDisable(GL_TEXTURE_GEN_R);
+	glDisable(GL_TEXTURE_GEN_Q);
+	glMatrixMode(GL_TEXTURE);
+	glLoadIdentity();
+	glMatrixMode(GL_MODELVIEW);
+	pglActiveTexture(GL_TEXTURE0);
+}
+
+/*********************************************************************************************
+	PARALLEL RENDERING
+*********************************************************************************************/
+#ifdef __linux__
+// Sort-last rendering of triangle meshes. Forked worker processes each rasterize a share of
+// the faces into their own colour and depth buffers in shared memory, then composite them by
+// direct send: every worker takes a strip of rows and keeps the nearest fragment of all
+// buffers in it. The master draws the composited image into the frame.
+const int maxParallelWorkers = 64;
+const int parallelMaxSize = 2048;  // Largest viewport drawn by the workers
+
+// Start of the shared memory, followed by the worker buffers and the composited buffer
+struct ParallelControl {
+	sem_t start[maxParallelWorkers];  // Posted by the master to start a frame
+	sem_t done;                       // Posted by each worker once its strip is composited
+	pthread_barrier_t rendered;       // Workers wait here until all partitions are drawn
+	int quit;
+	int width;
+	int height;
+	GLfloat modelview[16];
+	GLfloat projection[16];
+	GLfloat light[4];                 // GL_LIGHT0 position in eye space
+};
+
+ParallelControl * parallelControl = NULL;
+size_t parallelBytes = 0;
+int parallelRunning = 0;               // Workers forked for the current mesh
+std::vector<pid_t> parallelPids;
+unsigned int parallelGeneration = 0;   // Mesh generation the workers were forked with
+double parallelFrameMs = 0.0;
+std::chrono::steady_clock::time_point parallelReportTime;
+
+// Colour (RGBA) and depth buffers of worker w, worker parallelRunning is the composited image
+unsigned char * parallelColour(int w) {
+	size_t offset = (sizeof(ParallelControl) + 4095) / 4096 * 4096;
+	return (unsigned char *)parallelControl + offset + (size_t)w * parallelMaxSize * parallelMaxSize * 8;
+}
+
+float * parallelDepth(int w) {
+	return (float *)(parallelColour(w) + (size_t)parallelMaxSize * parallelMaxSize * 4);
+}
+
+// Transforms a point by a column-major matrix
+void transformPoint(const GLfloat m[16], const float p[4], float out[4]) {
+	for (int k = 0; k < 4; k++) {
+		out[k] = m[k] * p[0] + m[4 + k] * p[1] + m[8 + k] * p[2] + m[12 + k] * p[3];
+	}
+}
+
+// Rasterizes one triangle given in clip space, in front of the near plane, with depth testing
+void rasterizeTriangle(const float clip[3][4], int width, int height, unsigned char blue, unsigned char * colour, float * depth) {
+	float screen[3][3];
+	for (int i = 0; i < 3; i++) {
+		screen[i][0] = (clip[i][0] / clip[i][3] * 0.5f + 0.5f) * width;
+		screen[i][1] = (clip[i][1] / clip[i][3] * 0.5f + 0.5f) * height;
+		screen[i][2] = clip[i][2] / clip[i][3] * 0.5f + 0.5f;
+	}
+	float area = (screen[1][0] - screen[0][0]) * (screen[2][1] - screen[0][1]) -
+		(screen[1][1] - screen[0][1]) * (screen[2][0] - screen[0][0]);
+	if (fabs(area) < 1e-12f) {
+		return;
+	}
+
+	int minX = std::max(0, (int)floor(std::min(screen[0][0], std::min(screen[1][0], screen[2][0]))));
+	int maxX = std::min(width - 1, (int)ceil(std::max(screen[0][0], std::max(screen[1][0], screen[2][0]))));
+	int minY = std::max(0, (int)floor(std::min(screen[0][1], std::min(screen[1][1], screen[2][1]))));
+	int maxY = std::min(height - 1, (int)ceil(std::max(screen[0][1], std::max(screen[1][1], screen[2][1]))));
+	for (int y = minY; y <= maxY; y++) {
+		float py = y + 0.5f;
+		for (int x = minX; x <= maxX; x++) {
+			float px = x + 0.5f;
+			// Barycentric weights from the edge functions, all the same sign inside
+			float w0 = ((screen[2][0] - screen[1][0]) * (py - screen[1][1]) - (screen[2][1] - screen[1][1]) * (px - screen[1][0])) / area;
+			float w1 = ((screen[0][0] - screen[2][0]) * (py - screen[2][1]) - (screen[0][1] - screen[2][1]) * (px - screen[2][0])) / area;
+			float w2 = 1.0f - w0 - w1;
+			if (w0 < 0.0f || w1 < 0.0f || w2 < 0.0f) {
+				continue;
+			}
+			float z = w0 * screen[0][2] + w1 * screen[1][2] + w2 * screen[2][2];
+			size_t pixel = (size_t)y * width + x;
+			if (z <= depth[pixel]) {
+				depth[pixel] = z;
+				colour[pixel * 4 + 0] = 0;
+				colour[pixel * 4 + 1] = 0;
+				colour[pixel * 4 + 2] = blue;
+				colour[pixel * 4 + 3] = 255;
+			}
+		}
+	}
+}
+
+// Rasterizes faces first to last of triVertexIndices into a worker's buffers, lit like
+// emitTriangleFace: blue with the global ambient and GL_LIGHT0's diffuse term. Faces crossing
+// the near plane are clipped against it, as OpenGL does, and drawn as a fan.
+void rasterizePartition(const ParallelControl &control, size_t first, size_t last, unsigned char * colour, float * depth) {
+	int width = control.width;
+	int height = control.height;
+	std::fill(colour, colour + (size_t)width * height * 4, 0);
+	std::fill(depth, depth + (size_t)width * height, 1.0f);
+
+	GLfloat mvp[16];
+	multiplyMatrices(control.projection, control.modelview, mvp);
+	float lightLength = vectorLength({ control.light[0], control.light[1], control.light[2] });
+	float light[3] = { control.light[0] / lightLength, control.light[1] / lightLength, control.light[2] / lightLength };
+
+	for (size_t f = first; f < last; f++) {
+		const std::array<int, 3> &face = triVertexIndices[f];
+		float clip[3][4];
+		int inside = 0;
+		for (int i = 0; i < 3; i++) {
+			const std::array<float, 3> &v = vertices[face[i] - 1];
+			float p[4] = { v[0], v[1], v[2], 1.0f };
+			transformPoint(mvp, p, clip[i]);
+			inside += clip[i][2] >= -clip[i][3];
+		}
+		if (inside == 0) {
+			continue;
+		}
+
+		// Flat shading from the face normal in eye space
+		std::array<float, 3> normal = calcNormal(vertices[face[0] - 1], vertices[face[1] - 1], vertices[face[2] - 1]);
+		std::array<float, 3> eyeNormal;
+		for (int k = 0; k < 3; k++) {
+			eyeNormal[k] = control.modelview[k] * normal[0] + control.modelview[4 + k] * normal[1] + control.modelview[8 + k] * normal[2];
+		}
+		float normalLength = vectorLength(eyeNormal);
+		float diffuse = normalLength > 0.0f
+			? std::max(0.0f, (eyeNormal[0] * light[0] + eyeNormal[1] * light[1] + eyeNormal[2] * light[2]) / normalLength)
+			: 0.0f;
+		unsigned char blue = (unsigned char)(std::min(1.0f, 0.2f + diffuse) * 255.0f + 0.5f);
+
+		if (inside == 3) {
+			rasterizeTriangle(clip, width, height, blue, colour, depth);
+			continue;
+		}
+
+		// Keeps the part in front of the near plane (z >= -w), at most a quad
+		float polygon[4][4];
+		int count = 0;
+		for (int i = 0; i < 3; i++) {
+			const float * a = clip[i];
+			const float * b = clip[(i + 1) % 3];
+			float da = a[2] + a[3];
+			float db = b[2] + b[3];
+			if (da >= 0.0f) {
+				memcpy(polygon[count++], a, sizeof(polygon[0]));
+			}
+			if ((da >= 0.0f) != (db >= 0.0f)) {
+				float t = da / (da - db);
+				for (int k = 0; k < 4; k++) {
+					polygon[count][k] = a[k] + (b[k] - a[k]) * t;
+				}
+				count++;
+			}
+		}
+		for (int i = 1; i + 1 < count; i++) {
+			float triangle[3][4];
+			memcpy(triangle[0], polygon[0], sizeof(triangle[0]));
+			memcpy(triangle[1], polygon[i], sizeof(triangle[1]));
+			memcpy(triangle[2], polygon[i + 1], sizeof(triangle[2]));
+			rasterizeTriangle(triangle, width, height, blue, colour, depth);
+		}
+	}
+}
+
+// Keeps the nearest fragment of every worker's buffers in rows first to last
+void compositeRows(int first, int last) {
+	int width = parallelControl->width;
+	unsigned char * colour = parallelColour(parallelRunning);
+	float * depth = parallelDepth(parallelRunning);
+	for (size_t pixel = (size_t)first * width; pixel < (size_t)last * width; pixel++) {
+		int nearest = 0;
+		for (int w = 1; w < parallelRunning; w++) {
+			if (parallelDepth(w)[pixel] < parallelDepth(nearest)[pixel]) {
+				nearest = w;
+			}
+		}
+		depth[pixel] = parallelDepth(nearest)[pixel];
+		memcpy(&colour[pixel * 4], &parallelColour(nearest)[pixel * 4], 4);
+	}
+}
+
+// Worker process - draws its share of the faces and composites its strip for every frame
+void parallelWorker(int worker) {
+	size_t faces = triVertexIndices.size();
+	size_t first = faces * worker / parallelRunning;
+	size_t last = faces * (worker + 1) / parallelRunning;
+	while (true) {
+		while (sem_wait(&parallelControl->start[worker]) != 0) {
+		}
+		if (parallelControl->quit) {
+			return;
+		}
+		rasterizePartition(*parallelControl, first, last, parallelColour(worker), parallelDepth(worker));
+		pthread_barrier_wait(&parallelControl->rendered);
+		int height = parallelControl->height;
+		compositeRows(height * worker / parallelRunning, height * (worker + 1) / parallelRunning);
+		sem_post(&parallelControl->done);
+	}
+}
+
+// Stops the workers and releases the shared memory, registered with atexit
+void stopParallelWorkers() {
+	if (parallelControl == NULL) {
+		return;
+	}
+	parallelControl->quit = 1;
+	for (size_t w = 0; w < parallelPids.size(); w++) {
+		sem_post(&parallelControl->start[w]);
+	}
+	for (size_t w = 0; w < parallelPids.size(); w++) {
+		waitpid(parallelPids[w], NULL, 0);
+	}
+	parallelPids.clear();
+	for (int w = 0; w < maxParallelWorkers; w++) {
+		sem_destroy(&parallelControl->start[w]);
+	}
+	sem_destroy(&parallelControl->done);
+	// The barrier is not destroyed, glibc waits in pthread_barrier_destroy for processes still
+	// inside it, which a killed worker never leaves. Unmapping the memory releases it.
+	munmap(parallelControl, parallelBytes);
+	parallelControl = NULL;
+	parallelRunning = 0;
+}
+
+// Waits until every worker has composited its strip. Returns false if a worker has exited, e.g.
+// it crashed or was killed, or if no worker has finished for 30 seconds.
+bool waitParallelWorkers() {
+	int finished = 0;
+	std::chrono::steady_clock::time_point progress = std::chrono::steady_clock::now();
+	while (finished < parallelRunning) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += 100000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec += 1;
+			deadline.tv_nsec -= 1000000000;
+		}
+		if (sem_timedwait(&parallelControl->done, &deadline) == 0) {
+			finished++;
+			progress = std::chrono::steady_clock::now();
+			continue;
+		}
+		for (size_t w = 0; w < parallelPids.size(); w++) {
+			if (waitpid(parallelPids[w], NULL, WNOHANG) == parallelPids[w]) {
+				printf("Render worker %zu exited\n", w);
+				return false;
+			}
+		}
+		if (std::chrono::steady_clock::now() - progress > std::chrono::seconds(30)) {
+			printf("Render workers stopped responding\n");
+			return false;
+		}
+	}
+	return true;
+}
+
+// Forks the workers for the current mesh. They inherit the mesh arrays as they are now, so
+// they are started again whenever the mesh changes.
+bool startParallelWorkers() {
+	static bool registered = false;
+	if (!registered) {
+		atexit(stopParallelWorkers);
+		registered = true;
+	}
+
+	int workers = std::min(parallelWorkers, maxParallelWorkers);
+	parallelBytes = (sizeof(ParallelControl) + 4095) / 4096 * 4096 + (size_t)(workers + 1) * parallelMaxSize * parallelMaxSize * 8;
+	// Pages are only backed once a worker touches them
+	void * memory = mmap(NULL, parallelBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (memory == MAP_FAILED) {
+		return false;
+	}
+	parallelControl = new (memory) ParallelControl();
+	for (int w = 0; w < maxParallelWorkers; w++) {
+		sem_init(&parallelControl->start[w], 1, 0);
+	}
+	sem_init(&parallelControl->done, 1, 0);
+	pthread_barrierattr_t attr;
+	pthread_barrierattr_init(&attr);
+	pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_barrier_init(&parallelControl->rendered, &attr, workers);
+	pthread_barrierattr_destroy(&attr);
+	parallelRunning = workers;
+
+	for (int w = 0; w < workers; w++) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			// Dies with the master, and never runs the master's atexit handlers
+			prctl(PR_SET_PDEATHSIG, SIGKILL);
+			parallelWorker(w);
+			_exit(0);
+		}
+		if (pid < 0) {
+			// The barrier counts every worker, so a partial set can't render
+			printf("Could not start render worker %d\n", w);
+			stopParallelWorkers();
+			return false;
+		}
+		parallelPids.push_back(pid);
+	}
+	parallelGeneration = meshGeneration;
+	printf("%d render workers started, about %zu faces each\n", workers, triVertexIndices.size() / workers);
+	return true;
+}
+
+// Called before anything else is drawn into the cleared frame. Renders the current triangle
+// mesh in face mode on the workers, placed by rotation, and draws the composited colour and
+// depth. Returns false if the mesh should be drawn by OpenGL as usual, which is also the case
+// if the workers fail.
+bool drawParallelFrame(const GLfloat rotation[16], char mode) {
+	if (parallelWorkers <= 0 || mode != 'f' || (renderobj != '2' && renderobj != '3') || triVertexIndices.empty()) {
+		return false;
+	}
+	// The shared buffers hold at most parallelMaxSize x parallelMaxSize pixels, larger frames
+	// are drawn with OpenGL rather than squashed into them
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	if (viewport[2] > parallelMaxSize || viewport[3] > parallelMaxSize) {
+		return false;
+	}
+	if (parallelControl != NULL && parallelGeneration != meshGeneration) {
+		stopParallelWorkers();
+	}
+	if (parallelControl == NULL && !startParallelWorkers()) {
+		parallelWorkers = 0;
+		return false;
+	}
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	parallelControl->width = viewport[2];
+	parallelControl->height = viewport[3];
+	glPushMatrix();
+	placeObject(renderobj, rotation);
+	glGetFloatv(GL_MODELVIEW_MATRIX, parallelControl->modelview);
+	glPopMatrix();
+	glGetFloatv(GL_PROJECTION_MATRIX, parallelControl->projection);
+	glGetLightfv(GL_LIGHT0, GL_POSITION, parallelControl->light);
+
+	for (int w = 0; w < parallelRunning; w++) {
+		sem_post(&parallelControl->start[w]);
+	}
+	if (!waitParallelWorkers()) {
+		// The others may be stuck at the barrier waiting for the lost worker
+		for (size_t w = 0; w < parallelPids.size(); w++) {
+			kill(parallelPids[w], SIGKILL);
+		}
+		stopParallelWorkers();
+		parallelWorkers = 0;
+		printf("Parallel rendering off, drawing with OpenGL\n");
+		return false;
+	}
+
+	// Depth first with colour writes off, then colour over the covered pixels only
+	glMatrixMode(GL_PROJECTION);
+	glPushMatrix();
+	glLoadIdentity();
+	glMatrixMode(GL_MODELVIEW);
+	glPushMatrix();
+	glLoadIdentity();
+	glRasterPos2f(-1.0f, -1.0f);
+	glDepthFunc(GL_ALWAYS);
+	glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+	glDrawPixels(parallelControl->width, parallelControl->height, GL_DEPTH_COMPONENT, GL_FLOAT, parallelDepth(parallelRunning));
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+	glDepthMask(GL_FALSE);
+	glEnable(GL_ALPHA_TEST);
+	glAlphaFunc(GL_GREATER, 0.0f);
+	glDrawPixels(parallelControl->width, parallelControl->height, GL_RGBA, GL_UNSIGNED_BYTE, parallelColour(parallelRunning));
+	glDisable(GL_ALPHA_TEST);
+	glDepthMask(GL_TRUE);
+	glDepthFunc(GL_LEQUAL);
+	glPopMatrix();
+	glMatrixMode(GL_PROJECTION);
+	glPopMatrix();
+	glMatrixMode(GL_MODELVIEW);
+
+	parallelFrameMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	if (now - parallelReportTime > std::chrono::seconds(1)) {
+		printf("Parallel rendering: %d workers, %.1f ms per frame\n", parallelRunning, parallelFrameMs);
+		parallelReportTime = now;
+	}
+	return true;
+}
+#else
+// Worker processes need fork and process shared semaphores, the mesh is drawn by OpenGL
+bool drawParallelFrame(const GLfloat rotation[16], char mode) {
+	return false;
+}
+#endif
+
+/*********************************************************************************************
+	INPUT RECORDING
+*********************************************************************************************/
+
+// Defined with the other input callbacks, replay feeds recorded presses back through them
+void keyboard(unsigned char key, int x, int y);
+void arrow_keys(int a_keys, int x, int y);
+
+// A recorded input event. Stored as 13 bytes: frame, time, kind and key.
+struct RecordedInput {
+	uint32_t frame;   // Frame the event arrived before
+	uint32_t timeMs;  // Time since recording started
+	uint8_t kind;     // 0 standard key, 1 arrow key, 2 end of recording
+	int32_t key;
+};
+
+FILE * recordLog = NULL;
+std::chrono::steady_clock::time_point recordStart;
+
+std::vector<RecordedInput> replayLog;
+size_t replayNext = 0;
+std::chrono::steady_clock::time_point replayStart;
+std::vector<float> frameTimes;       // Frame times measured during a replay
+std::chrono::steady_clock::time_point frameStart;
+
+// Writes one event to the log
+void writeRecordedInput(const RecordedInput &event) {
+	fwrite(&event.frame, 4, 1, recordLog);
+	fwrite(&event.timeMs, 4, 1, recordLog);
+	fwrite(&event.kind, 1, 1, recordLog);
+	fwrite(&event.key, 4, 1, recordLog);
+}
+
+// Appends the end marker and closes the log, registered with atexit
+void stopRecording() {
+	if (recordLog == NULL) {
+		return;
+	}
+	RecordedInput end = { displayFrame, (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now() - recordStart).count(), 2, 0 };
+	writeRecordedInput(end);
+	fclose(recordLog);
+	recordLog = NULL;
+}
+
+// Starts writing every key press to the log file
+bool startRecording(const char * filename) {
+	recordLog = fopen(filename, "wb");
+	if (recordLog == NULL) {
+		printf("Could not write %s\n", filename);
+		return false;
+	}
+	fwrite("INPLOG1", 8, 1, recordLog);
+	recordStart = std::chrono::steady_clock::now();
+	atexit(stopRecording);
+	return true;
+}
+
+// Called from the input callbacks, logs the event when recording
+void recordInput(uint8_t kind, int key) {
+	if (recordLog == NULL || !replayLog.empty()) {
+		return;
+	}
+	RecordedInput event = { displayFrame, (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now() - recordStart).count(), kind, key };
+	writeRecordedInput(event);
+}
+
+// Prints the frame time summary of a replay and writes every frame's time if asked to
+void finishReplay() {
+	if (!timingsFile.empty()) {
+		FILE * file = fopen(timingsFile.c_str(), "w");
+		if (file != NULL) {
+			fprintf(file, "frame,ms\n");
+			for (size_t i = 0; i < frameTimes.size(); i++) {
+				fprintf(file, "%zu,%.3f\n", i, frameTimes[i]);
+			}
+			fclose(file);
+		}
+	}
+
+	std::vector<float> sorted = frameTimes;
+	std::sort(sorted.begin(), sorted.end());
+	if (sorted.empty()) {
+		return;
+	}
+	double total = 0.0;
+	for (size_t i = 0; i < sorted.size(); i++) {
+		total += sorted[i];
+	}
+	printf("Replay: %zu frames, mean %.2f ms, p50 %.2f ms, p95 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+		sorted.size(), total / sorted.size(), sorted[sorted.size() / 2], sorted[sorted.size() * 95 / 100],
+		sorted[sorted.size() * 99 / 100], sorted.back());
+}
+
+// Reads a log for replay
+bool loadReplay(const char * filename) {
+	FILE * file = fopen(filename, "rb");
+	char magic[8];
+	if (file == NULL || fread(magic, 8, 1, file) != 1 || memcmp(magic, "INPLOG1", 8) != 0) {
+		printf("%s is not an input log\n", filename);
+		if (file != NULL) fclose(file);
+		return false;
+	}
+	RecordedInput event;
+	while (fread(&event.frame, 4, 1, file) == 1 && fread(&event.timeMs, 4, 1, file) == 1 &&
+		fread(&event.kind, 1, 1, file) == 1 && fread(&event.key, 4, 1, file) == 1) {
+		replayLog.push_back(event);
+	}
+	fclose(file);
+	// The summary is printed however the replay ends, including a recorded Escape
+	atexit(finishReplay);
+	replaying = !replayLog.empty();
+	printf("%s: replaying %zu events %s\n", filename, replayLog.size(), replayFast ? "as fast as possible" : "at recorded speed");
+	return !replayLog.empty();
+}
+
+// Called at the start of display(). Feeds the events that are due back through the input
+// callbacks, then waits until the update thread has applied them. With --replay-fast events are
+// due by frame number, so every run draws the same sequence of frames. At recorded speed they
+// are due by time, so which frame an event lands in depends on how fast the frames are drawn.
+void replayInputs() {
+	if (replayLog.empty()) {
+		return;
+	}
+	if (replayNext == 0 && displayFrame == 0) {
+		replayStart = std::chrono::steady_clock::now();
+	}
+	uint32_t now = (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now() - replayStart).count();
+
+	while (replayNext < replayLog.size()) {
+		const RecordedInput &event = replayLog[replayNext];
+		if (replayFast ? event.frame > displayFrame : event.timeMs > now) {
+			break;
+		}
+		replayNext++;
+		if (event.kind == 0) {
+			keyboard((unsigned char)event.key, 0, 0);
+		}
+		else if (event.kind == 1) {
+			arrow_keys(event.key, 0, 0);
+		}
+		else {
+			exit(0);
+		}
+	}
+
+	while (acquireFrame().inputsApplied < inputsPushed) {
+		std::this_thread::yield();
+	}
+}
+
+// Frame timing during a replay. glFinish makes the time include the GPU's work.
+void beginFrameTiming() {
+	frameStart = std::chrono::steady_clock::now();
+}
+
+void endFrameTiming() {
+	if (replayLog.empty()) {
+		return;
+	}
+	glFinish();
+	frameTimes.push_back(std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - frameStart).count());
 }
 
 /*********************************************************************************************
@@ -699,29 +4374,57 @@ void elephant() {
 *********************************************************************************************/
 // Callback function that draws the requested objects
 void display(void) {
+	beginFrameTiming();
+
+	// Feeds recorded input back in when replaying
+	replayInputs();
+
+	// Applies objects parsed by the loader thread and asset changes picked up by the watcher thread
+	applyFinishedLoads();
+	applyPendingReloads();
+
+	// Takes the newest state published by the update thread
+	const FrameState &frame = acquireFrame();
+	GLfloat objRotation[16];
+	objectMatrix(frame, objRotation);
+
+	// Draws the shadow map again only if the light or the object changed
+	bool shadowed = frame.rendermode == 'f' && updateShadowMap(objRotation);
+
+	// Draws into the offscreen target when running below full resolution
+	bool scaled = beginScaledFrame(frame);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
 	glLoadIdentity();
 
-	// Set the camera.
-	gluLookAt(cam[0], cam[1], cam[2],
-						camVectors[3][0], camVectors[3][1], camVectors[3][2],
+	// Set the camera, moved around the turntable orbit when it is running
+	std::array<float, 3> eye = orbiting ? orbitCamera(frame) : frame.cam;
+	gluLookAt(eye[0], eye[1], eye[2],
+						frame.look[0], frame.look[1], frame.look[2],
 						0.0f, 1.0f, 0.0f);
 
 	// Lighting - default values for all properties
 	GLfloat light_ambient[] = { 0.0, 0.0, 0.0, 1.0 };
 	GLfloat light_diffuse[] = { 1.0, 1.0, 1.0, 1.0 };
 	GLfloat light_specular[] = { 1.0, 1.0, 1.0, 1.0 };
-	GLfloat light_position[] = { 0.0, 5.0, 5.0, 0.0 };
 
 	glLightfv(GL_LIGHT0, GL_AMBIENT, light_ambient);
 	glLightfv(GL_LIGHT0, GL_DIFFUSE, light_diffuse);
 	glLightfv(GL_LIGHT0, GL_SPECULAR, light_specular);
-	glLightfv(GL_LIGHT0, GL_POSITION, light_position);
+	glLightfv(GL_LIGHT0, GL_POSITION, lightPosition);
+
+	// Triangle meshes are drawn by the worker processes when parallel rendering is on. The
+	// workers don't draw shadows, so shadowed frames are drawn by OpenGL.
+	bool parallel = !shadowed && drawParallelFrame(objRotation, frame.rendermode);
 
 	// Draw Cartesian coordinate system as lines
 	draw_axes();
 
+	// Shadow lookup, set up while the modelview holds only the camera
+	if (shadowed) {
+		beginShadowedDraw();
+	}
+
 	// Different objects
 
 	switch (renderobj) {
@@ -729,7 +4432,8 @@ void display(void) {
 		{
 			// Draw the cube using the draw_quad_obj function
 			glPushMatrix();
-			draw_quad_obj(loadCube);
+			placeObject(renderobj, objRotation);
+			draw_quad_obj(loadCube, frame.rendermode);
 			glPopMatrix();
 			break;
 		}
@@ -739,11 +4443,12 @@ void display(void) {
 			// Push top matrix of the stack, this is the matrix that represents the drawn object
 			glPushMatrix();
 			// Used OpenGL functions for scaling and translation
-			glTranslatef(-0.5, 0.0, 0.0);
-			glScalef(0.5, 0.5, 0.5);
+			placeObject(renderobj, objRotation);
 
 			// Draw the bunny object using the draw_triangular_obj function
-			draw_triangular_obj(loadBunny);
+			if (!parallel) {
+				draw_triangular_obj(loadBunny, frame.rendermode);
+			}
 
 			// Pop the matrix back onto the stack
 			glPopMatrix();
@@ -755,11 +4460,12 @@ void display(void) {
 			// Push top matrix of the stack, this is the matrix that represents the drawn object
 			glPushMatrix();
 			// Used OpenGL functions for scaling and translation
-			glTranslatef(-0.2, 4.0, 0.0);
-			glScalef(1.6, 1.6, 1.6);
+			placeObject(renderobj, objRotation);
 
 			// Draw the screwdriver object using the draw_triangular_obj function
-			draw_triangular_obj(loadSD);
+			if (!parallel) {
+				draw_triangular_obj(loadSD, frame.rendermode);
+			}
 
 			// Pop the matrix back onto the stack
 			glPopMatrix();
@@ -770,12 +4476,38 @@ void display(void) {
 		{
 			// Draw the elephant object
 			glPushMatrix();
-			draw_quad_obj(loadElephant);
+			placeObject(renderobj, objRotation);
+			draw_quad_obj(loadElephant, frame.rendermode);
+			glPopMatrix();
+			break;
+		}
+
+		case '5':
+		{
+			// Draw the streamed point cloud, as points whatever the render mode
+			glPushMatrix();
+			glMultMatrixf(objRotation);
+			drawPointCloud();
 			glPopMatrix();
 			break;
 		}
 	}
+	if (shadowed) {
+		endShadowedDraw();
+	}
+
+	// Scales the offscreen image up to the window
+	endScaledFrame(scaled);
+
+	// Reads the frame back for capture before it is swapped to the front
+	captureReadback();
+	if (orbiting) {
+		orbitStep = (orbitStep + 1) % orbitFrames;
+	}
 	glutSwapBuffers();
+
+	endFrameTiming();
+	displayFrame += 1;
 }
 
 
@@ -786,6 +4518,9 @@ void reshape(int width, int height) {
 	if (height == 0)
 		height = 1;
 
+	windowWidth = width;
+	windowHeight = height;
+
 	glViewport(0, 0, width, height);
 	glMatrixMode(GL_PROJECTION);
 	glLoadIdentity();
@@ -802,34 +4537,104 @@ void reshape(int width, int height) {
 	USER INPUT
 *********************************************************************************************/
 
-// Callback for standard keyboard presses.
+// Callback for standard keyboard presses. Loading objects needs the GL context so it happens
+// here, everything else is queued for the update thread.
 void keyboard(unsigned char key, int x, int y) {
+	recordInput(0, key);
+
 	switch (key) {
 		// Exit the program when escape is pressed
 		case 27:
+			// Writes out the frames still waiting in the capture buffers first
+			flushCaptureReadbacks();
 			exit(0);
 			break;
 
-		// Switch render mode.
-		case 'v': rendermode = 'v'; break;  // vertices
-		case 'e': rendermode = 'e'; break;  // edges
-		case 'f': rendermode = 'f'; break;  // faces
-
 		// Switch rendered object
 		case '1': cube(); break;  // cube
 		case '2': bunny(); break;  // bunny
 		case '3': screwdriver(); break;  // screwdriver
 		case '4': elephant(); break; // elephant
+		case '5': pointCloud(); break; // point cloud
+
+		// Frame capture
+		case 'c':  // start/stop writing frames to disk
+			capturing = !capturing;
+			if (capturing) {
+				startCaptureWorkers();
+			}
+			printf("Frame capture %s\n", capturing ? "on" : "off");
+			break;
+		case 'p':  // switch between PNG and raw PPM frames
+			captureFormat = captureFormat == 'p' ? 'r' : 'p';
+			printf("Capture format %s\n", captureFormat == 'p' ? "PNG" : "raw PPM");
+			break;
+		case 't':  // start/stop the turntable orbit
+			orbiting = !orbiting;
+			orbitStep = 0;
+			break;
+
+		// Occlusion culling on/off
+		case 'q':
+			occlusionCulling = !occlusionCulling;
+			printf("Occlusion culling %s\n", occlusionCulling && hasOcclusionQueries ? "on" : "off");
+			break;
+
+		// Dynamic resolution on/off
+		case 'r':
+			adaptiveResolution = !adaptiveResolution;
+			resolutionScale = 1.0f;
+			printf("Dynamic resolution %s, %.1f ms budget\n", adaptiveResolution ? "on" : "off", frameBudgetMs);
+			break;
+
+		// Shadows on/off
+		case 'h':
+			shadows = !shadows;
+			printf("Shadows %s\n", shadows && hasShadowMaps ? "on" : "off");
+			if (shadows && hasShadowMaps && parallelWorkers > 0) {
+				printf("Meshes are drawn with OpenGL instead of the render workers while shadows are on\n");
+			}
+			break;
+
+	default:
+		break;
+	}
+
+	pushInput(false, key);
+	glutPostRedisplay();
+}
+
+// Arrow keys need to be handled in a separate function from other keyboard presses.
+void arrow_keys(int a_keys, int x, int y) {
+	recordInput(1, a_keys);
+	pushInput(true, a_keys);
+	glutPostRedisplay();
+}
+
+// Applies a standard key press on the update thread.
+void applyKey(unsigned char key) {
+	switch (key) {
+		// Switch render mode.
+		case 'v': rendermode = 'v'; break;  // vertices
+		case 'e': rendermode = 'e'; break;  // edges
+		case 'f': rendermode = 'f'; break;  // faces
+
+		// A newly loaded object starts unrotated
+		case '1':
+		case '2':
+		case '3':
+		case '4':
+		case '5': resetObjectAxes(); break;
 
 		// Rotate object positive
-		case 'i': rotateY(vertices, 1); break; // Yaw Positive
-		case 'o': rotateZ(vertices, 1); break; // Roll Positive
-		case 'l': rotateX(vertices, 1); break; // Pitch Positive
+		case 'i': rotateY(objAxes, 1); break; // Yaw Positive
+		case 'o': rotateZ(objAxes, 1); break; // Roll Positive
+		case 'l': rotateX(objAxes, 1); break; // Pitch Positive
 
 		// Rotate object positive
-		case 'k': rotateY(vertices, -1); break; // Yaw Negative
-		case 'u': rotateZ(vertices, -1); break; // Roll Negative
-		case 'j': rotateX(vertices, -1); break; // Pitch Negative
+		case 'k': rotateY(objAxes, -1); break; // Yaw Negative
+		case 'u': rotateZ(objAxes, -1); break; // Roll Negative
+		case 'j': rotateX(objAxes, -1); break; // Pitch Negative
 
 		// Rotates the camera viewport by 10 degrees about the Z axis when pressed
 		case 'x': rotateCam(3); break;  
@@ -854,12 +4659,10 @@ void keyboard(unsigned char key, int x, int y) {
 	default:
 		break;
 	}
-
-	glutPostRedisplay();
 }
 
-// Arrow keys need to be handled in a separate function from other keyboard presses.
-void arrow_keys(int a_keys, int x, int y) {
+// Applies an arrow key press on the update thread.
+void applySpecialKey(int a_keys) {
 	switch (a_keys) {
 	case GLUT_KEY_UP:
 		// Rotates the camera viewport by 10 degrees about Y axis when pressed
@@ -884,8 +4687,6 @@ void arrow_keys(int a_keys, int x, int y) {
 	default:
 		break;
 	}
-
-	glutPostRedisplay();
 }
 
 
@@ -905,13 +4706,108 @@ void mouseMove(int x, int y)
 // Note: You may wish to add interactivity like clicking and dragging to move the camera.
 //       In that case, please use the above functions.
 
+/*********************************************************************************************
+	UPDATE THREAD
+*********************************************************************************************/
+
+std::atomic<bool> updateRunning(false);
+std::thread updateThread;
+
+// Applies queued input to the camera and object state and publishes a new frame whenever
+// something changed. Runs until stopUpdateThread is called.
+void updateLoop() {
+	while (updateRunning.load()) {
+		bool changed = false;
+		InputEvent event;
+		while (popInput(event)) {
+			if (event.special) {
+				applySpecialKey(event.key);
+			}
+			else {
+				applyKey((unsigned char)event.key);
+			}
+			inputsApplied += 1;
+			changed = true;
+		}
+
+		if (changed) {
+			publishFrame();
+		}
+		else {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}
+}
+
+// Fills every frame buffer with the initial state and starts the update thread
+void startUpdateThread() {
+	for (int i = 0; i < 3; i++) {
+		writeFrameState(frameBuffers[i]);
+	}
+	updateRunning = true;
+	updateThread = std::thread(updateLoop);
+}
+
+// Stops the update thread, registered with atexit so exit() from any callback is safe
+void stopUpdateThread() {
+	updateRunning = false;
+	if (updateThread.joinable()) {
+		updateThread.join();
+	}
+}
+
 /*********************************************************************************************
 	MAIN FUNCTION
 *********************************************************************************************/
 
 // Entry point to the application.
 int main(int argc, char** argv) {
+	// Converts a point file to an octree and exits, this needs no window
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--build-octree") == 0 && i + 2 < argc) {
+			return buildOctree(argv[i + 1], argv[i + 2], octreeChunkPoints) ? 0 : 1;
+		}
+	}
+
 	glutInit(&argc, argv);
+
+	// Options left over once GLUT has taken its own
+	const char * replayFile = NULL;
+	bool watchFiles = true;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--frame-budget") == 0 && i + 1 < argc) {
+			float budget = (float)atof(argv[++i]);
+			if (budget > 0.0f) frameBudgetMs = budget;
+		}
+		else if (strcmp(argv[i], "--pointcloud") == 0 && i + 1 < argc) {
+			pointCloudFile = argv[++i];
+		}
+		else if (strcmp(argv[i], "--point-budget") == 0 && i + 1 < argc) {
+			cloudPointBudget = (size_t)atol(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+			startRecording(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+			replayFile = argv[++i];
+		}
+		else if (strcmp(argv[i], "--replay-fast") == 0) {
+			replayFast = true;
+		}
+		else if (strcmp(argv[i], "--timings") == 0 && i + 1 < argc) {
+			timingsFile = argv[++i];
+		}
+		else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+			parallelWorkers = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--no-watch") == 0) {
+			watchFiles = false;
+		}
+	}
+	if (replayFile != NULL) {
+		loadReplay(replayFile);
+	}
+
 	glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_MULTISAMPLE);
 	glutInitWindowSize(500, 500);
 	glutCreateWindow("CM20219 OpenGL Coursework");
@@ -920,6 +4816,18 @@ int main(int argc, char** argv) {
 	rendermode = 'v';
 
 	camStartPos(); // Sets the camera's initial position coordinates
+	resetObjectAxes();
+
+	// Camera and object state are updated on their own thread from here on
+	startUpdateThread();
+	atexit(stopUpdateThread);
+
+	// Reloads the current object's files when they change on disk. Not during a replay, where a
+	// reload would make the run differ from the recording.
+	if (watchFiles && replayFile == NULL) {
+		startAssetWatcher();
+	}
+
 	// Callback functions
 	glutDisplayFunc(display);
 	glutReshapeFunc(reshape);